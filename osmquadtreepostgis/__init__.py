@@ -142,6 +142,8 @@ def type_str(ct):
         return 'float'
     elif ct==opg.GeometryColumnType.Hstore:
         return 'hstore'
+    elif ct==opg.GeometryColumnType.Json:
+        return 'jsonb'
     elif ct==opg.GeometryColumnType.Geometry:
         return 'geometry(Geometry,3857)'
     elif ct==opg.GeometryColumnType.PointGeometry:
@@ -182,7 +184,11 @@ def create_tables(curs, table_prfx,coltags):
 
 
             
-def write_indices(curs,table_prfx, inds):
+def write_indices(curs,table_prfx, inds, queue=None):
+    if queue is not None:
+        queue.extend(ii.replace("%ZZ%", table_prfx) for ii in inds)
+        return
+    
     ist=time.time()
     
     for ii in inds:
@@ -198,6 +204,23 @@ def write_indices(curs,table_prfx, inds):
     
     print("created indices in %8.1fs" % (time.time()-ist))
 
+def write_indices_parallel(connstr, queries, numconnections, maintenance_work_mem=None):
+    #run queries (collected by passing queue to write_indices) over
+    #numconnections connections. Queries may be (query, maintenance_work_mem)
+    #tuples: otherwise maintenance_work_mem is set for index builds and
+    #vacuums.
+    
+    jobs=[]
+    for qu in queries:
+        mem=''
+        if isinstance(qu, tuple):
+            qu,mem = qu
+        elif maintenance_work_mem and qu.lower().lstrip().startswith(('create index','vacuum')):
+            mem=maintenance_work_mem
+        jobs.append(opg.IndexJob(qu, mem))
+    
+    return opg.run_index_jobs(connstr, jobs, numconnections)
+
 
 planetosm = [
 "drop view if exists planet_osm_point",
@@ -356,20 +379,20 @@ def find_polygon_cols(curs, table_prfx,skip=set(['way','way_point'])):
 
     
 
-def write_extended_indices_pointline(curs, table_prfx):
+def write_extended_indices_pointline(curs, table_prfx, queue=None):
     
-    write_indices(curs, table_prfx, extended_indices_pointline)
+    write_indices(curs, table_prfx, extended_indices_pointline, queue)
     
-def write_extended_indices_polygon(curs, table_prfx):
+def write_extended_indices_polygon(curs, table_prfx, queue=None):
     
     poly_cols = find_polygon_cols(curs, table_prfx)
     
     inds = extended_indices_polygon[:]    
     inds.append("create view %ZZ%polygon_point as select "+poly_cols+", way_point as way from %ZZ%polygon where way_point is not null")
     
-    write_indices(curs, table_prfx, inds)
+    write_indices(curs, table_prfx, inds, queue)
     
-def write_planetosm_views(curs, table_prfx):
+def write_planetosm_views(curs, table_prfx, queue=None):
     inds = planetosm[:]
     roadspp = min(i for i,ind in enumerate(inds) if not 'drop' in ind and 'planet_osm_roads' in ind)
     
@@ -377,9 +400,9 @@ def write_planetosm_views(curs, table_prfx):
     
     inds.insert(roadspp, "create view planet_osm_polygon as (select "+poly_cols+" from %ZZ%polygon union all select "+poly_cols+" from %ZZ%building)")
     
-    write_indices(curs, table_prfx, inds)
+    write_indices(curs, table_prfx, inds, queue)
 
-def create_tables_lowzoom(curs, prfx, newprefix, minzoom, simp=None, cols=None,table_names=None, polygonpoint=True):
+def create_tables_lowzoom(curs, prfx, newprefix, minzoom, simp=None, cols=None,table_names=None, polygonpoint=True, queue=None):
     
     
     queries = []
@@ -432,10 +455,10 @@ def create_tables_lowzoom(curs, prfx, newprefix, minzoom, simp=None, cols=None,t
         
     
     print("call %d queries..." % len(queries))
-    write_indices(curs,newprefix,queries)
+    write_indices(curs,newprefix,queries,queue)
     
     
-def create_views_lowzoom(curs, prfx, newprefix, minzoom, indices=True, table_names=None):
+def create_views_lowzoom(curs, prfx, newprefix, minzoom, indices=True, table_names=None, queue=None):
     
     
     
@@ -454,7 +477,7 @@ def create_views_lowzoom(curs, prfx, newprefix, minzoom, indices=True, table_nam
         queries.append("create index %ZZ%polygon_waypoint on "+prfx+"polygon using gist(way_point) where way_point is not null and minzoom <= "+str(minzoom))
         queries.append("create index %ZZ%boundary_way_exterior on "+prfx+"boundary using gist(way_exterior) where way_exterior is not null and minzoom <= "+str(minzoom))
     
-    write_indices(curs,newprefix,queries)
+    write_indices(curs,newprefix,queries,queue)
 
 
 def get_db_conn(connstring):
@@ -462,7 +485,7 @@ def get_db_conn(connstring):
     conn.autocommit=True
     return conn
 
-def write_to_postgis(prfx, box_in,connstr, tabprfx, stylefn=None, writeindices=True, lastdate=None,minzoom=None,nothread=False, numchan=4, minlen=0,minarea=5,use_binary=True,extended=True):
+def write_to_postgis(prfx, box_in,connstr, tabprfx, stylefn=None, writeindices=True, lastdate=None,minzoom=None,nothread=False, numchan=4, minlen=0,minarea=5,use_binary=True,extended=True,persistent_copy=False,async_copy=False,commit_blocks=0,commit_bytes=0,resume=False,table_connections=None,table_mode=None,freeze=False,unlogged=False,partition_depth=0,index_connections=0,maintenance_work_mem=None,reorder_window=0,coalesce_bytes=0,coalesce_rows=0,coalesce_seconds=0,writer_queue_bytes=None,buffer_pool_bytes=None,geometry_threads=0,geometry_pool_min_points=None,num_packers=0,alloc_rules=None,block_alloc_func=None,stats=None):
     if not connstr or not tabprfx:
         raise Exception("must specify connstr and tabprfx")
         
@@ -478,6 +501,13 @@ def write_to_postgis(prfx, box_in,connstr, tabprfx, stylefn=None, writeindices=T
     
     if extended:
         postgisparams.alloc_func='extended'
+    if alloc_rules is not None:
+        #list of TableAllocRule: the first matching rule gives the tables
+        postgisparams.alloc_func=alloc_rules
+    if block_alloc_func is not None:
+        #called once per block with a TableAllocBlock, returning the tables
+        #for each element: overrides alloc_func
+        postgisparams.block_alloc_func=block_alloc_func
     postgisparams.validate_geometry = True
     postgisparams.round_geometry = False
     
@@ -486,9 +516,45 @@ def write_to_postgis(prfx, box_in,connstr, tabprfx, stylefn=None, writeindices=T
     postgisparams.tableprfx = tabprfx + ('_' if tabprfx and not tabprfx.endswith('_') else '')
     postgisparams.connstring = connstr
     postgisparams.use_binary=use_binary
-    
-    
-    if postgisparams.connstring!='null':
+    postgisparams.writer_options.persistent_copy=persistent_copy
+    postgisparams.writer_options.async_copy=async_copy
+    postgisparams.writer_options.commit_blocks=commit_blocks
+    postgisparams.writer_options.commit_bytes=commit_bytes
+    postgisparams.writer_options.resume=resume
+    if table_connections:
+        postgisparams.table_connections=table_connections
+    
+    if (freeze or unlogged or partition_depth) and not resume:
+        #tables have to be created by the writers. A resumed import must
+        #keep the existing tables, so leave table_mode unset to be rejected
+        if table_mode is None:
+            table_mode='create'
+    if table_mode=='create':
+        postgisparams.writer_options.table_mode=opg.TableLoadMode.Create
+    elif table_mode=='truncate':
+        postgisparams.writer_options.table_mode=opg.TableLoadMode.Truncate
+    elif table_mode is not None:
+        raise Exception("unexpected table_mode "+repr(table_mode))
+    postgisparams.writer_options.freeze=freeze
+    postgisparams.writer_options.unlogged=unlogged
+    postgisparams.writer_options.partition_depth=partition_depth
+    postgisparams.reorder_window=reorder_window
+    postgisparams.coalesce.max_bytes=coalesce_bytes
+    postgisparams.coalesce.max_rows=coalesce_rows
+    postgisparams.coalesce.max_seconds=coalesce_seconds
+    if writer_queue_bytes is not None:
+        postgisparams.writer_queue_bytes=writer_queue_bytes
+    if buffer_pool_bytes is not None:
+        postgisparams.buffer_pool_bytes=buffer_pool_bytes
+    postgisparams.geometry_threads=geometry_threads
+    if geometry_pool_min_points is not None:
+        postgisparams.geometry_pool_min_points=geometry_pool_min_points
+    postgisparams.num_packers=num_packers
+    if stats is not None:
+        #a PostgisStats, filled in with the pack and write timings
+        postgisparams.stats=stats
+    
+    if postgisparams.connstring!='null' and not resume and table_mode is None:
         with get_db_conn(postgisparams.connstring) as conn:
             create_tables(conn.cursor(), postgisparams.tableprfx, postgisparams.coltags)
     
@@ -501,18 +567,22 @@ def write_to_postgis(prfx, box_in,connstr, tabprfx, stylefn=None, writeindices=T
         errs = opg.process_geometry_postgis(params, postgisparams, None)#Prog(locs=params.locs))
         
     if writeindices and postgisparams.connstring!='null':
+        queue = [] if index_connections else None
         with get_db_conn(postgisparams.connstring) as conn:
             if extended:
-                write_extended_indices_pointline(conn.cursor(), postgisparams.tableprfx)
-                write_extended_indices_polygon(conn.cursor(), postgisparams.tableprfx)
+                write_extended_indices_pointline(conn.cursor(), postgisparams.tableprfx, queue)
+                write_extended_indices_polygon(conn.cursor(), postgisparams.tableprfx, queue)
                 
-                write_planetosm_views(conn.cursor(), postgisparams.tableprfx)
-                create_tables_lowzoom(conn.cursor(), postgisparams.tableprfx, postgisparams.tableprfx+'lz6_', 6, simp=612)
-                create_views_lowzoom(conn.cursor(), postgisparams.tableprfx, postgisparams.tableprfx+'lz9_', 9)
-                create_views_lowzoom(conn.cursor(), postgisparams.tableprfx, postgisparams.tableprfx+'lz11_', 11)
+                write_planetosm_views(conn.cursor(), postgisparams.tableprfx, queue)
+                create_tables_lowzoom(conn.cursor(), postgisparams.tableprfx, postgisparams.tableprfx+'lz6_', 6, simp=612, queue=queue)
+                create_views_lowzoom(conn.cursor(), postgisparams.tableprfx, postgisparams.tableprfx+'lz9_', 9, queue=queue)
+                create_views_lowzoom(conn.cursor(), postgisparams.tableprfx, postgisparams.tableprfx+'lz11_', 11, queue=queue)
             else:
-                write_indices(conn.cursor(), postgisparams.tableprfx, default_indices_pointline)
-                write_indices(conn.cursor(), postgisparams.tableprfx, default_indices_polygon)
+                write_indices(conn.cursor(), postgisparams.tableprfx, default_indices_pointline, queue)
+                write_indices(conn.cursor(), postgisparams.tableprfx, default_indices_polygon, queue)
+        
+        if queue is not None:
+            write_indices_parallel(postgisparams.connstring, queue, index_connections, maintenance_work_mem)
     return errs
 
 class CsvWriter:
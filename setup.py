@@ -37,7 +37,7 @@ class my_build_ext(build_ext):
 ext_modules = []
 
 
-srcs = ['src/processpostgis.cpp', 'src/postgiswriter.cpp', 'src/postgis_python.cpp', 'src/validategeoms.cpp']
+srcs = ['src/processpostgis.cpp', 'src/postgiswriter.cpp', 'src/postgis_python.cpp', 'src/validategeoms.cpp', 'src/indexbuilder.cpp', 'src/workpool.cpp', 'src/tablealloc.cpp', 'src/postgisstats.cpp']
 modname = 'osmquadtreepostgis._osmquadtreepostgis'
 
 ext_modules.append(
@@ -0,0 +1,280 @@
+/*****************************************************************************
+ *
+ * This file is part of osmquadtreepostgis
+ *
+ * Copyright (C) 2019 James Harris
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#include "indexbuilder.hpp"
+#include "oqt/utils/logger.hpp"
+
+#include <postgresql/libpq-fe.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <iomanip>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace oqt {
+namespace geometry {
+
+std::vector<std::string> split_tokens(const std::string& query) {
+    std::vector<std::string> res;
+    std::string curr;
+    for (char c: query) {
+        if (std::isalnum((unsigned char) c) || (c=='_') || (c=='.') || (c=='"')) {
+            curr += std::tolower((unsigned char) c);
+        } else {
+            if (!curr.empty()) {
+                res.push_back(curr);
+                curr.clear();
+            }
+            if (c=='(') {
+                res.push_back("(");
+            }
+        }
+    }
+    if (!curr.empty()) {
+        res.push_back(curr);
+    }
+    return res;
+}
+
+std::vector<std::string> query_relations(const std::string& query) {
+    static const std::set<std::string> keywords = {"on", "from", "join", "table", "view", "analyze", "exists", "index", "into", "vacuum", "cluster", "verbose", "full", "freeze"};
+    static const std::set<std::string> skip = {"if", "not", "only", "concurrently", "(", "select", "using", "exists", "table", "view", "index", "analyze", "verbose", "full", "freeze"};
+    
+    auto tokens = split_tokens(query);
+    std::vector<std::string> res;
+    for (size_t i=0; i+1 < tokens.size(); i++) {
+        if (keywords.count(tokens[i]) && !skip.count(tokens[i+1])) {
+            res.push_back(tokens[i+1]);
+        }
+    }
+    std::sort(res.begin(), res.end());
+    res.erase(std::unique(res.begin(), res.end()), res.end());
+    return res;
+}
+
+bool is_index_build(const std::string& query) {
+    auto tokens = split_tokens(query);
+    if (tokens.size()<2) { return false; }
+    if (tokens[0]!="create") { return false; }
+    return (tokens[1]=="index") || ((tokens[1]=="unique") && (tokens.size()>2) && (tokens[2]=="index"));
+}
+
+std::string short_query(const std::string& query) {
+    std::string res;
+    for (char c: query) {
+        if (std::isspace((unsigned char) c)) {
+            if (!res.empty() && (res.back()!=' ')) {
+                res += ' ';
+            }
+        } else {
+            res += c;
+        }
+    }
+    if (res.size()>120) {
+        res = res.substr(0,117)+"...";
+    }
+    return res;
+}
+
+class IndexScheduler {
+    public:
+        IndexScheduler(const std::string& connection_string_, const std::vector<IndexJob>& jobs_)
+            : connection_string(connection_string_), jobs(jobs_), state(jobs_.size(), Pending), num_done(0), failed(false) {
+            
+            start_time = std::chrono::steady_clock::now();
+            
+            std::vector<std::vector<std::string>> relations;
+            std::vector<bool> index_build;
+            for (const auto& jb: jobs) {
+                relations.push_back(query_relations(jb.query));
+                index_build.push_back(is_index_build(jb.query));
+            }
+            
+            depends.resize(jobs.size());
+            for (size_t i=0; i < jobs.size(); i++) {
+                for (size_t j=0; j < i; j++) {
+                    if (index_build[i] && index_build[j]) { continue; }
+                    
+                    //a job whose relations aren't known may touch any table
+                    if (relations[i].empty() || relations[j].empty()) {
+                        depends[i].push_back(j);
+                        continue;
+                    }
+                    
+                    std::vector<std::string> common;
+                    std::set_intersection(relations[i].begin(), relations[i].end(),
+                        relations[j].begin(), relations[j].end(),
+                        std::back_inserter(common));
+                    if (!common.empty()) {
+                        depends[i].push_back(j);
+                    }
+                }
+            }
+        }
+        
+        std::vector<IndexJobResult> run(size_t numconnections) {
+            if (numconnections==0) { numconnections=1; }
+            
+            std::vector<std::thread> threads;
+            for (size_t i=0; i < numconnections; i++) {
+                threads.push_back(std::thread([this,i]() { run_connection(i); }));
+            }
+            for (auto& t: threads) {
+                t.join();
+            }
+            
+            if (failed) {
+                throw std::domain_error("run_index_jobs failed: "+error);
+            }
+            
+            double total=0;
+            for (const auto& r: results) {
+                total += r.duration;
+            }
+            Logger::Message() << "ran " << results.size() << " queries on " << numconnections << " connections in "
+                << std::fixed << std::setprecision(1) << elapsed() << "s [" << total << "s total]";
+            
+            std::sort(results.begin(), results.end(), [](const IndexJobResult& l, const IndexJobResult& r) { return l.start < r.start; });
+            return results;
+        }
+    
+    private:
+        enum JobState { Pending, Running, Done };
+        
+        std::string connection_string;
+        std::vector<IndexJob> jobs;
+        std::vector<std::vector<size_t>> depends;
+        std::vector<JobState> state;
+        size_t num_done;
+        
+        std::mutex mutex;
+        std::condition_variable cond;
+        bool failed;
+        std::string error;
+        
+        std::chrono::steady_clock::time_point start_time;
+        std::vector<IndexJobResult> results;
+        
+        double elapsed() const {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now()-start_time).count();
+        }
+        
+        //first pending job whose dependencies have finished
+        int64_t next_job() const {
+            for (size_t i=0; i < jobs.size(); i++) {
+                if (state[i]!=Pending) { continue; }
+                bool ready=true;
+                for (auto j: depends[i]) {
+                    if (state[j]!=Done) {
+                        ready=false;
+                        break;
+                    }
+                }
+                if (ready) { return i; }
+            }
+            return -1;
+        }
+        
+        void run_connection(size_t idx) {
+            PGconn* conn=nullptr;
+            std::string current_mem;
+            
+            while (true) {
+                int64_t job=-1;
+                {
+                    std::unique_lock<std::mutex> lk(mutex);
+                    cond.wait(lk, [this,&job]() {
+                        if (failed || (num_done==jobs.size())) { return true; }
+                        job = next_job();
+                        return job>=0;
+                    });
+                    if (job<0) { break; }
+                    state[job]=Running;
+                }
+                
+                const auto& jb = jobs[job];
+                double st = elapsed();
+                std::string err;
+                try {
+                    if (!conn) {
+                        conn = PQconnectdb(connection_string.c_str());
+                        if ((!conn) || (PQstatus(conn)!=CONNECTION_OK)) {
+                            throw std::domain_error("connection to postgresql failed");
+                        }
+                    }
+                    if (jb.maintenance_work_mem!=current_mem) {
+                        if (jb.maintenance_work_mem.empty()) {
+                            exec(conn, "reset maintenance_work_mem");
+                        } else {
+                            exec(conn, "set maintenance_work_mem = '"+jb.maintenance_work_mem+"'");
+                        }
+                        current_mem = jb.maintenance_work_mem;
+                    }
+                    exec(conn, jb.query);
+                } catch (std::exception& ex) {
+                    err = ex.what();
+                }
+                double dur = elapsed()-st;
+                
+                {
+                    std::lock_guard<std::mutex> lk(mutex);
+                    state[job]=Done;
+                    num_done++;
+                    if (!err.empty()) {
+                        Logger::Message() << "[" << idx << "] " << short_query(jb.query) << " failed: " << err;
+                        failed=true;
+                        error=err;
+                    } else {
+                        Logger::Message() << "[" << idx << "] " << std::left << std::setw(120) << short_query(jb.query)
+                            << std::right << " " << std::fixed << std::setprecision(1) << std::setw(7) << dur << "s";
+                        results.push_back(IndexJobResult(jb.query, idx, st, dur));
+                    }
+                }
+                cond.notify_all();
+            }
+            if (conn) {
+                PQfinish(conn);
+            }
+        }
+        
+        static void exec(PGconn* conn, const std::string& sql) {
+            auto res = PQexec(conn, sql.c_str());
+            int r = PQresultStatus(res);
+            PQclear(res);
+            if ((r!=PGRES_COMMAND_OK) && (r!=PGRES_TUPLES_OK)) {
+                throw std::domain_error(PQerrorMessage(conn));
+            }
+        }
+};
+
+std::vector<IndexJobResult> run_index_jobs(const std::string& connection_string, const std::vector<IndexJob>& jobs, size_t numconnections) {
+    IndexScheduler sched(connection_string, jobs);
+    return sched.run(numconnections);
+}
+
+}
+}
@@ -0,0 +1,63 @@
+/*****************************************************************************
+ *
+ * This file is part of osmquadtreepostgis
+ *
+ * Copyright (C) 2019 James Harris
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef OSMQUADTREEPOSTGIS_INDEXBUILDER_HPP
+#define OSMQUADTREEPOSTGIS_INDEXBUILDER_HPP
+
+#include <string>
+#include <vector>
+
+namespace oqt {
+namespace geometry {
+
+struct IndexJob {
+    IndexJob(const std::string& query_, const std::string& maintenance_work_mem_) : query(query_), maintenance_work_mem(maintenance_work_mem_) {}
+    std::string query;
+    
+    //eg "4GB": set for this job only. If empty the server default is used.
+    std::string maintenance_work_mem;
+};
+
+struct IndexJobResult {
+    IndexJobResult(const std::string& query_, size_t connection_, double start_, double duration_)
+        : query(query_), connection(connection_), start(start_), duration(duration_) {}
+    std::string query;
+    size_t connection;
+    double start;
+    double duration;
+};
+
+//names of the relations referenced by query: the token following one of
+//on, from, join, table, view, analyze, exists, index, into, vacuum or
+//cluster (and vacuum's options)
+std::vector<std::string> query_relations(const std::string& query);
+
+//run jobs over numconnections connections. A job waits for all earlier
+//jobs referencing one of the same relations, except that index builds on
+//the same table run concurrently. A job with no relations found waits for
+//all earlier jobs, and all later jobs wait for it. Throws after the running jobs have
+//finished if any job fails.
+std::vector<IndexJobResult> run_index_jobs(const std::string& connection_string, const std::vector<IndexJob>& jobs, size_t numconnections);
+
+}
+}
+#endif
@@ -49,6 +49,8 @@
 #include "gzstream.hpp"
 
 #include "validategeoms.hpp"
+#include "tablealloc.hpp"
+#include "indexbuilder.hpp"
 #include <cmath> 
 using namespace oqt;
 
@@ -124,6 +126,11 @@ geometry::mperrorvec process_geometry_postgis_py(const geometry::GeometryParamet
     return process_geometry_postgis(params, postgis, wrapped);
 }
     
+std::vector<geometry::IndexJobResult> run_index_jobs_py(const std::string& connection_string, const std::vector<geometry::IndexJob>& jobs, size_t numconnections) {
+    py::gil_scoped_release r;
+    return geometry::run_index_jobs(connection_string, jobs, numconnections);
+}
+
 geometry::mperrorvec process_geometry_postgis_nothread_py(const geometry::GeometryParameters& params, const geometry::PostgisParameters& postgis, external_callback cb) {
     
     py::gil_scoped_release r;
@@ -216,56 +223,105 @@ geometry::mperrorvec process_geometry_csvcallback_write(const geometry::Geometry
     
     return process_geometry_csvcallback(params, postgis, wrapped, csvblock_callback);
 }
-std::vector<std::string> extended_table_alloc(ElementPtr geom) {
-    if (geom->Type()==ElementType::Point) {
-        return {"point"};
-    }
-    
-    if (geom->Type()==ElementType::Linestring) {
-        auto ln = std::dynamic_pointer_cast<geometry::Linestring>(geom);
-        if (ln->ZOrder()) {
-            return {"highway"};
-        } else {
-            return {"line"};
+ElementType element_type_from_string(const std::string& s) {
+    if (s=="point") { return ElementType::Point; }
+    if (s=="linestring") { return ElementType::Linestring; }
+    if (s=="simplepolygon") { return ElementType::SimplePolygon; }
+    if (s=="complicatedpolygon") { return ElementType::ComplicatedPolygon; }
+    throw std::domain_error("unknown geometry type "+s);
+}
+
+std::string element_type_to_string(ElementType ty) {
+    if (ty==ElementType::Point) { return "point"; }
+    if (ty==ElementType::Linestring) { return "linestring"; }
+    if (ty==ElementType::SimplePolygon) { return "simplepolygon"; }
+    if (ty==ElementType::ComplicatedPolygon) { return "complicatedpolygon"; }
+    return "unknown";
+}
+
+//view of a block passed to a python block_alloc_func, giving each
+//property for all the elements at once
+class TableAllocBlock {
+    public:
+        TableAllocBlock(PrimitiveBlockPtr block_) : block(block_) {}
+        
+        size_t size() const { return block->Objects().size(); }
+        PrimitiveBlockPtr get_block() const { return block; }
+        
+        std::vector<std::string> types() const {
+            std::vector<std::string> result;
+            result.reserve(size());
+            for (const auto& ele: block->Objects()) {
+                result.push_back(element_type_to_string(ele->Type()));
+            }
+            return result;
         }
-    }   
-    
-    if (geom->Type()==ElementType::SimplePolygon) {
-        bool is_building=false;
-        for (const auto& tg: geom->Tags()) {
-            if ((tg.key=="building") && (tg.val != "no")) {
-                is_building=true;
+        
+        std::vector<int64> ids() const {
+            std::vector<int64> result;
+            result.reserve(size());
+            for (const auto& ele: block->Objects()) {
+                result.push_back(ele->Id());
             }
+            return result;
         }
-        if (is_building) {
-            return {"building"};
+        
+        //the value of key for each element, or None
+        py::list tag_values(const std::string& key) const {
+            py::list result;
+            for (const auto& ele: block->Objects()) {
+                const std::string* val=nullptr;
+                for (const auto& tg: ele->Tags()) {
+                    if (tg.key==key) {
+                        val = &tg.val;
+                        break;
+                    }
+                }
+                if (val) {
+                    result.append(py::str(*val));
+                } else {
+                    result.append(py::none());
+                }
+            }
+            return result;
+        }
+        
+        std::vector<std::pair<std::string,std::string>> tags(size_t i) const {
+            std::vector<std::pair<std::string,std::string>> result;
+            for (const auto& tg: block->Objects().at(i)->Tags()) {
+                result.push_back(std::make_pair(tg.key, tg.val));
+            }
+            return result;
         }
-        return {"polygon"};
         
-    }   
+    private:
+        PrimitiveBlockPtr block;
+};
+
+void set_params_block_alloc_func(geometry::PostgisParameters& gp, py::object obj) {
+    if (obj.is_none()) {
+        gp.block_alloc_func = nullptr;
+        return;
+    }
     
-    if (geom->Type() == ElementType::ComplicatedPolygon) {
-        bool is_boundary=false;
-        bool is_building=false;
+    //the function is called with a TableAllocBlock and returns a list
+    //giving the tables (or None) for each element
+    auto p = py::cast<std::function<py::object(std::shared_ptr<TableAllocBlock>)>>(obj);
+    gp.block_alloc_func = [p](PrimitiveBlockPtr bl) {
+        py::gil_scoped_acquire g;
+        auto lst = p(std::make_shared<TableAllocBlock>(bl)).cast<py::list>();
         
-        for (const auto& tg: geom->Tags()) {
-            if ((tg.key=="type") && (tg.val == "boundary")) {
-                is_boundary=true;
-            }
-            if ((tg.key=="building") && (tg.val != "no")) {
-                is_building=true;
+        std::vector<std::vector<std::string>> result;
+        result.reserve(lst.size());
+        for (size_t i=0; i < lst.size(); i++) {
+            if (lst[i].is_none()) {
+                result.push_back({});
+            } else {
+                result.push_back(lst[i].cast<std::vector<std::string>>());
             }
         }
-        if (is_boundary) {
-            return {"polygon","boundary"};
-        }
-        if (is_building) {
-            return {"building"};
-        }
-        return {"polygon"};
-        
-    }   
-    return {};
+        return result;
+    };
 }
 
 void set_params_alloc_func(geometry::PostgisParameters& gp, py::object obj) {
@@ -280,10 +336,17 @@ void set_params_alloc_func(geometry::PostgisParameters& gp, py::object obj) {
             return;
         }
         if (s=="extended") {
-            gp.alloc_func = extended_table_alloc;
+            gp.alloc_func = geometry::make_rule_table_alloc(geometry::extended_table_alloc_rules());
             return;
         }
     } catch (...) {}
+    if (py::isinstance<py::list>(obj) || py::isinstance<py::tuple>(obj)) {
+        try {
+            auto rules = py::cast<std::vector<geometry::TableAllocRule>>(obj);
+            gp.alloc_func = geometry::make_rule_table_alloc(rules);
+            return;
+        } catch (py::cast_error&) {}
+    }
     try {
         auto p = py::cast<geometry::table_alloc_func>(obj);
         gp.alloc_func = [p](ElementPtr e) {
@@ -305,13 +368,59 @@ void osmquadtreepostgis_defs(py::module& m) {
     
     
     py::class_<geometry::CsvBlock, std::shared_ptr<geometry::CsvBlock>>(m,"CsvBlock")
-        .def_property_readonly("rows", &geometry::CsvBlock::rows);
+        .def_property_readonly("rows", [](const geometry::CsvBlock& bl) {
+            std::map<std::string,geometry::CsvRows> result;
+            for (const auto& r: bl.rows()) {
+                result.emplace(r.first, r.second);
+            }
+            return result;
+        })
+        .def_property_readonly("quadtree", &geometry::CsvBlock::quadtree)
+        .def_property_readonly("index", &geometry::CsvBlock::index)
+        .def_property_readonly("tiles", &geometry::CsvBlock::tiles);
     ;
     py::class_<geometry::CsvRows>(m, "CsvRows")
         .def("__getitem__", &geometry::CsvRows::at)
         .def("__len__", &geometry::CsvRows::size)
         .def("data", [](const geometry::CsvRows& c) { return py::bytes(c.data_blob()); })
     ;
+    py::enum_<geometry::TableLoadMode>(m, "TableLoadMode")
+        .value("Existing", geometry::TableLoadMode::Existing)
+        .value("Create", geometry::TableLoadMode::Create)
+        .value("Truncate", geometry::TableLoadMode::Truncate)
+    ;
+    py::class_<geometry::PostgisWriterOptions>(m, "PostgisWriterOptions")
+        .def(py::init<>())
+        .def_readwrite("persistent_copy", &geometry::PostgisWriterOptions::persistent_copy)
+        .def_readwrite("async_copy", &geometry::PostgisWriterOptions::async_copy)
+        .def_readwrite("inflight_bytes", &geometry::PostgisWriterOptions::inflight_bytes)
+        .def_readwrite("commit_blocks", &geometry::PostgisWriterOptions::commit_blocks)
+        .def_readwrite("commit_bytes", &geometry::PostgisWriterOptions::commit_bytes)
+        .def_readwrite("resume", &geometry::PostgisWriterOptions::resume)
+        .def_readwrite("table_mode", &geometry::PostgisWriterOptions::table_mode)
+        .def_readwrite("freeze", &geometry::PostgisWriterOptions::freeze)
+        .def_readwrite("unlogged", &geometry::PostgisWriterOptions::unlogged)
+        .def_readwrite("partition_depth", &geometry::PostgisWriterOptions::partition_depth)
+        .def_readwrite("stats", &geometry::PostgisWriterOptions::stats)
+    ;
+    py::class_<geometry::StageCounters>(m, "StageCounters")
+        .def_readonly("calls", &geometry::StageCounters::calls)
+        .def_readonly("rows", &geometry::StageCounters::rows)
+        .def_readonly("bytes", &geometry::StageCounters::bytes)
+        .def_readonly("seconds", &geometry::StageCounters::seconds)
+    ;
+    py::class_<geometry::PostgisStats, std::shared_ptr<geometry::PostgisStats>>(m, "PostgisStats")
+        .def(py::init<>())
+        .def_property_readonly("stages", &geometry::PostgisStats::stages)
+        .def("summary", &geometry::PostgisStats::summary)
+        .def("reset", &geometry::PostgisStats::reset)
+    ;
+    py::class_<geometry::CoalesceParameters>(m, "CoalesceParameters")
+        .def(py::init<>())
+        .def_readwrite("max_bytes", &geometry::CoalesceParameters::max_bytes)
+        .def_readwrite("max_rows", &geometry::CoalesceParameters::max_rows)
+        .def_readwrite("max_seconds", &geometry::CoalesceParameters::max_seconds)
+    ;
     py::class_<geometry::PostgisParameters>(m, "PostgisParameters")
         .def(py::init<>())
         .def_readwrite("connstring", &geometry::PostgisParameters::connstring)
@@ -319,9 +428,20 @@ void osmquadtreepostgis_defs(py::module& m) {
         .def_readwrite("coltags", &geometry::PostgisParameters::coltags)
         .def_readwrite("use_binary", &geometry::PostgisParameters::use_binary)
         .def_property("alloc_func", [](geometry::PostgisParameters& gp) { return gp.alloc_func; }, &set_params_alloc_func) 
+        .def_property("block_alloc_func", [](geometry::PostgisParameters& gp) { return gp.block_alloc_func; }, &set_params_block_alloc_func)
         .def_readwrite("split_multipolygons", &geometry::PostgisParameters::split_multipolygons)
         .def_readwrite("validate_geometry", &geometry::PostgisParameters::validate_geometry)
         .def_readwrite("round_geometry", &geometry::PostgisParameters::round_geometry)
+        .def_readwrite("writer_options", &geometry::PostgisParameters::writer_options)
+        .def_readwrite("table_connections", &geometry::PostgisParameters::table_connections)
+        .def_readwrite("reorder_window", &geometry::PostgisParameters::reorder_window)
+        .def_readwrite("coalesce", &geometry::PostgisParameters::coalesce)
+        .def_readwrite("writer_queue_bytes", &geometry::PostgisParameters::writer_queue_bytes)
+        .def_readwrite("buffer_pool_bytes", &geometry::PostgisParameters::buffer_pool_bytes)
+        .def_readwrite("geometry_threads", &geometry::PostgisParameters::geometry_threads)
+        .def_readwrite("geometry_pool_min_points", &geometry::PostgisParameters::geometry_pool_min_points)
+        .def_readwrite("num_packers", &geometry::PostgisParameters::num_packers)
+        .def_readwrite("stats", &geometry::PostgisParameters::stats)
     ;
     
     m.def("process_geometry_postgis", &process_geometry_postgis_py);
@@ -336,13 +456,98 @@ void osmquadtreepostgis_defs(py::module& m) {
         .def("finish", &geometry::PostgisWriter::finish)
         .def("call", &geometry::PostgisWriter::call)
     ;
-    m.def("make_postgiswriter", &geometry::make_postgiswriter);
+    m.def("prepare_import_journal", &geometry::prepare_import_journal);
+    m.def("prepare_tables", &geometry::prepare_tables);
+    m.def("finish_tables", &geometry::finish_tables);
+    m.def("partition_table", &geometry::partition_table);
+    m.def("set_csvrows_pool_limit", &geometry::set_csvrows_pool_limit);
+    m.def("csvrows_pool_size", &geometry::csvrows_pool_size);
+    
+    py::class_<geometry::IndexJob>(m, "IndexJob")
+        .def(py::init<std::string,std::string>(), py::arg("query"), py::arg("maintenance_work_mem")="")
+        .def_readwrite("query", &geometry::IndexJob::query)
+        .def_readwrite("maintenance_work_mem", &geometry::IndexJob::maintenance_work_mem)
+    ;
+    py::class_<geometry::IndexJobResult>(m, "IndexJobResult")
+        .def_readonly("query", &geometry::IndexJobResult::query)
+        .def_readonly("connection", &geometry::IndexJobResult::connection)
+        .def_readonly("start", &geometry::IndexJobResult::start)
+        .def_readonly("duration", &geometry::IndexJobResult::duration)
+    ;
+    m.def("query_relations", &geometry::query_relations);
+    m.def("run_index_jobs", &run_index_jobs_py);
+    m.def("make_postgiswriter", &geometry::make_postgiswriter,
+        py::arg("connection_string"), py::arg("table_prfx"), py::arg("with_header"), py::arg("binary_format"),
+        py::arg("options")=geometry::PostgisWriterOptions());
     
     py::class_<geometry::PackCsvBlocks, std::shared_ptr<geometry::PackCsvBlocks>>(m, "PackCsvBlocks")
         .def("call", &geometry::PackCsvBlocks::call)
     ;
-    m.def("make_pack_csvblocks", &geometry::make_pack_csvblocks);
-    m.def("extended_table_alloc", &extended_table_alloc);
+    m.def("make_pack_csvblocks", [](const geometry::PackCsvBlocks::tagspec& tags, bool with_header, bool binary_format, geometry::table_alloc_func table_alloc, bool split_multipolygons, bool validate_polygons, bool round_geometry) {
+        return geometry::make_pack_csvblocks(tags, with_header, binary_format, table_alloc, split_multipolygons, validate_polygons, round_geometry);
+    });
+    
+    py::class_<geometry::PackCsvBlocksBenchmark>(m, "PackCsvBlocksBenchmark")
+        .def_readonly("num_blocks", &geometry::PackCsvBlocksBenchmark::num_blocks)
+        .def_readonly("num_rows", &geometry::PackCsvBlocksBenchmark::num_rows)
+        .def_readonly("text_seconds", &geometry::PackCsvBlocksBenchmark::text_seconds)
+        .def_readonly("text_bytes", &geometry::PackCsvBlocksBenchmark::text_bytes)
+        .def_readonly("binary_seconds", &geometry::PackCsvBlocksBenchmark::binary_seconds)
+        .def_readonly("binary_bytes", &geometry::PackCsvBlocksBenchmark::binary_bytes)
+    ;
+    m.def("benchmark_pack_csvblocks", &geometry::benchmark_pack_csvblocks,
+        py::arg("tags"), py::arg("blocks"), py::arg("table_alloc")=geometry::table_alloc_func(),
+        py::arg("split_multipolygons")=true, py::arg("repeats")=1);
+    
+    py::enum_<geometry::TagPredicateOp>(m, "TagPredicateOp")
+        .value("Exists", geometry::TagPredicateOp::Exists)
+        .value("Missing", geometry::TagPredicateOp::Missing)
+        .value("Equals", geometry::TagPredicateOp::Equals)
+        .value("NotEquals", geometry::TagPredicateOp::NotEquals)
+    ;
+    py::class_<geometry::TagPredicate>(m, "TagPredicate")
+        .def(py::init<std::string,geometry::TagPredicateOp,std::vector<std::string>>(),
+            py::arg("key"), py::arg("op")=geometry::TagPredicateOp::Exists, py::arg("values")=std::vector<std::string>())
+        .def_readwrite("key", &geometry::TagPredicate::key)
+        .def_readwrite("op", &geometry::TagPredicate::op)
+        .def_readwrite("values", &geometry::TagPredicate::values)
+    ;
+    //geometry types as "point", "linestring", "simplepolygon" or "complicatedpolygon"
+    py::class_<geometry::TableAllocRule>(m, "TableAllocRule")
+        .def(py::init([](const std::vector<std::string>& types, const std::vector<geometry::TagPredicate>& tags, const std::vector<std::string>& tables) {
+            std::vector<ElementType> tt;
+            for (const auto& t: types) { tt.push_back(element_type_from_string(t)); }
+            return geometry::TableAllocRule(tt, tags, tables);
+        }), py::arg("types"), py::arg("tags"), py::arg("tables"))
+        .def_property("types",
+            [](const geometry::TableAllocRule& r) {
+                std::vector<std::string> tt;
+                for (auto t: r.types) { tt.push_back(element_type_to_string(t)); }
+                return tt;
+            },
+            [](geometry::TableAllocRule& r, const std::vector<std::string>& types) {
+                r.types.clear();
+                for (const auto& t: types) { r.types.push_back(element_type_from_string(t)); }
+            })
+        .def_readwrite("tags", &geometry::TableAllocRule::tags)
+        .def_readwrite("has_zorder", &geometry::TableAllocRule::has_zorder)
+        .def_readwrite("min_area", &geometry::TableAllocRule::min_area)
+        .def_readwrite("max_area", &geometry::TableAllocRule::max_area)
+        .def_readwrite("min_length", &geometry::TableAllocRule::min_length)
+        .def_readwrite("max_length", &geometry::TableAllocRule::max_length)
+        .def_readwrite("tables", &geometry::TableAllocRule::tables)
+    ;
+    py::class_<TableAllocBlock, std::shared_ptr<TableAllocBlock>>(m, "TableAllocBlock")
+        .def("__len__", &TableAllocBlock::size)
+        .def_property_readonly("block", &TableAllocBlock::get_block)
+        .def_property_readonly("types", &TableAllocBlock::types)
+        .def_property_readonly("ids", &TableAllocBlock::ids)
+        .def("tag_values", &TableAllocBlock::tag_values)
+        .def("tags", &TableAllocBlock::tags)
+    ;
+    m.def("extended_table_alloc_rules", &geometry::extended_table_alloc_rules);
+    m.def("make_rule_table_alloc", &geometry::make_rule_table_alloc);
+    m.def("extended_table_alloc", geometry::make_rule_table_alloc(geometry::extended_table_alloc_rules()));
     m.def("pack_hstoretags", &geometry::pack_hstoretags);
     m.def("pack_hstoretags_binary", &geometry::pack_hstoretags_binary);
     m.def("pack_jsontags_picojson", &geometry::pack_jsontags_picojson);
@@ -0,0 +1,97 @@
+/*****************************************************************************
+ *
+ * This file is part of osmquadtreepostgis
+ *
+ * Copyright (C) 2019 James Harris
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#include "postgisstats.hpp"
+
+#include <iomanip>
+#include <sstream>
+
+namespace oqt {
+namespace geometry {
+
+void PostgisStats::merge(const stage_counters& local) {
+    std::lock_guard<std::mutex> lk(mutex);
+    for (const auto& st: local) {
+        auto& stage = counters[st.first];
+        for (const auto& tc: st.second) {
+            stage[tc.first].add(tc.second);
+        }
+    }
+}
+
+void PostgisStats::add(const std::string& stage, const std::string& table, const StageCounters& c) {
+    std::lock_guard<std::mutex> lk(mutex);
+    counters[stage][table].add(c);
+}
+
+stage_counters PostgisStats::stages() const {
+    std::lock_guard<std::mutex> lk(mutex);
+    return counters;
+}
+
+void PostgisStats::reset() {
+    std::lock_guard<std::mutex> lk(mutex);
+    counters.clear();
+}
+
+std::string PostgisStats::summary() const {
+    auto cc = stages();
+    
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(2);
+    bool first=true;
+    for (const auto& st: cc) {
+        StageCounters tot;
+        for (const auto& tc: st.second) {
+            tot.add(tc.second);
+        }
+        if (!first) { ss << "\n"; }
+        first=false;
+        if (st.first=="queue") {
+            //the entries aren't comparable, so aren't added together
+            auto get = [&st](const std::string& k) {
+                auto it = st.second.find(k);
+                return it==st.second.end() ? StageCounters() : it->second;
+            };
+            ss << "queue: " << get("").calls << " blocks, high water "
+               << (get("high_water").bytes/1024.0/1024.0) << "mb, average depth "
+               << (get("average_depth").bytes/1024.0/1024.0) << "mb, blocked "
+               << get("blocked").calls << " times for " << get("blocked").seconds << "s";
+            continue;
+        }
+        ss << st.first << ": " << tot.seconds << "s, " << tot.calls << " calls, "
+           << tot.rows << " rows, " << (tot.bytes/1024.0/1024.0) << "mb";
+    }
+    return ss.str();
+}
+
+void flush_stage_counters(PostgisStats& stats, stage_counters& local) {
+    stats.merge(local);
+    for (auto& st: local) {
+        for (auto& tc: st.second) {
+            tc.second = StageCounters();
+        }
+    }
+}
+
+}
+}
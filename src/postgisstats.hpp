@@ -0,0 +1,117 @@
+/*****************************************************************************
+ *
+ * This file is part of osmquadtreepostgis
+ *
+ * Copyright (C) 2019 James Harris
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef OSMQUADTREEPOSTGIS_POSTGISSTATS_HPP
+#define OSMQUADTREEPOSTGIS_POSTGISSTATS_HPP
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace oqt {
+namespace geometry {
+
+struct StageCounters {
+    StageCounters() : calls(0), rows(0), bytes(0), seconds(0) {}
+    
+    size_t calls;
+    size_t rows;
+    size_t bytes;
+    double seconds;
+    
+    void add(const StageCounters& other) {
+        calls += other.calls;
+        rows += other.rows;
+        bytes += other.bytes;
+        seconds += other.seconds;
+    }
+};
+
+//counters for each stage, by table
+typedef std::map<std::string,std::map<std::string,StageCounters>> stage_counters;
+
+//timings and row and byte counts for the packing and writing stages:
+//  pack      time to pack each block (table ""), and the rows and bytes
+//            packed for each table
+//  geometry  time to prepare the geometry columns, including validation
+//  tags      time to encode the other_tags hstore or json
+//  copy      time to send the COPY data, and the rows and bytes sent
+//  server    time waiting for the server to finish each COPY
+//  queue     the writer queue: "" has the blocks queued as calls,
+//            "blocked" the times and seconds the packers were blocked,
+//            and "high_water" and "average_depth" the queued bytes
+//Each thread counts into its own stage_counters, merged in once per block,
+//so the lock is not taken for each row.
+class PostgisStats {
+    public:
+        PostgisStats() {}
+        
+        void merge(const stage_counters& local);
+        void add(const std::string& stage, const std::string& table, const StageCounters& counters);
+        
+        stage_counters stages() const;
+        void reset();
+        
+        //one line for each stage
+        std::string summary() const;
+        
+    private:
+        mutable std::mutex mutex;
+        stage_counters counters;
+};
+
+//merge local into stats, then zero local: the entries are kept so that
+//pointers to them stay valid
+void flush_stage_counters(PostgisStats& stats, stage_counters& local);
+
+//adds one call (unless count_call is false) and the time until
+//destruction to counters, if set
+class StageTimer {
+    public:
+        StageTimer(StageCounters* counters_, bool count_call_=true) : counters(counters_), count_call(count_call_) {
+            if (counters) {
+                start = std::chrono::steady_clock::now();
+            }
+        }
+        
+        ~StageTimer() {
+            if (counters) {
+                if (count_call) {
+                    counters->calls++;
+                }
+                counters->seconds += std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+            }
+        }
+        
+        StageTimer(const StageTimer&) = delete;
+        StageTimer& operator=(const StageTimer&) = delete;
+        
+    private:
+        StageCounters* counters;
+        bool count_call;
+        std::chrono::steady_clock::time_point start;
+};
+
+}
+}
+#endif
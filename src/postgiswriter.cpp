@@ -39,9 +39,24 @@
 
 #include <iostream>
 #include <map>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <iomanip>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
 #include <postgresql/libpq-fe.h>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "picojson.h"
 #include "validategeoms.hpp"
+#include "workpool.hpp"
 
 namespace oqt {
 namespace geometry {
@@ -75,38 +90,18 @@ void quotestring(std::ostream& strm, const std::string& val) {
     strm << QuoteString{val};
 }
 
-std::string text_string(const std::string& val) {
-    std::stringstream ss;
-    ss << QuoteString{val};
-    return ss.str();
-}
-
-struct DoublePrec {
-    double v;
-    int dp;
-};
-
-std::ostream& operator<<(std::ostream& strm, const DoublePrec& d) {
-    strm << std::fixed << std::setprecision(d.dp) << d.v;
-    return strm;
-}
-
-std::string double_string(double v, bool round) {
-    std::stringstream ss;
-    if (round) {
-        ss << DoublePrec{v,1};
-    }
-    return ss.str();
-}
-
-std::ostream& writestring(std::ostream& strm, const std::string& val) {
-    if (!val.empty()) {
-        quotestring(strm,val);
+//lower case hex digits for each byte value
+struct HexPairs {
+    HexPairs() {
+        const char* digits = "0123456789abcdef";
+        for (size_t i=0; i < 256; i++) {
+            pairs[2*i] = digits[i>>4];
+            pairs[2*i+1] = digits[i&15];
+        }
     }
-    
-    return strm;
-}
-
+    char pairs[512];
+};
+const HexPairs hex_pairs;
 
 void json_quotestring(std::ostream& strm, const std::string& val) {
     strm << '"';
@@ -152,107 +147,183 @@ size_t _write_data(std::string& data, size_t pos, const std::string& v) {
 }
     
 
-std::string prep_tags(std::stringstream& strm, const std::map<std::string,size_t>& tags, ElementPtr obj, bool other_tags, bool asjson) {
-    std::vector<std::string> tt(tags.size(),"");
-    
-    tagvector others;
-    
-    if (!obj->Tags().empty()) {
-        for (const auto& tg:obj->Tags()) {
-            auto it=tags.find(tg.key);
-            if (it!=tags.end()) {
-                if (it->second >= tags.size()) {
-                    Logger::Message() << "tag out of bounds?? " << tg.key << " " << tg.val << "=>" << it->second << "/" << tt.size();
-                    throw std::domain_error("tag out of bounds");
+//maps tag keys to column numbers using a perfect hash of the keys: a lookup
+//is one hash and at most one string comparison.
+class TagColumnIndex {
+    public:
+        TagColumnIndex() : mask(0), seed(0), num_keys(0) {}
+        
+        void add(const std::string& key, size_t column) {
+            keys.push_back(std::make_pair(key, column));
+        }
+        
+        //choose a table size and seed with no collisions between the keys
+        void build() {
+            num_keys = keys.size();
+            size_t sz=1;
+            while (sz < 2*num_keys) { sz*=2; }
+            
+            while (true) {
+                for (uint32_t sd=1; sd < 1000; sd++) {
+                    if (try_build(sz, sd)) {
+                        return;
+                    }
                 }
-                tt.at(it->second)=tg.val;
-            } else if (other_tags) {
-                others.push_back(tg);
+                sz *= 2;
             }
         }
-    }
-    
-    
-    for (const auto& t:tt) {
-        writestring(strm,t) << delim;
         
-    }
-    if (other_tags) {
-        if (asjson) {
-            return pack_jsontags_picojson(others);
-        } else {
-            return pack_hstoretags(others);
+        //column for key, or -1
+        int find(const std::string& key) const {
+            if (num_keys==0) { return -1; }
+            const auto& sl = slots[hash(key, seed) & mask];
+            if ((sl.column<0) || (sl.key.size()!=key.size()) || (sl.key!=key)) {
+                return -1;
+            }
+            return sl.column;
         }
-    }
-    return std::string();            
-}
+        
+        size_t size() const { return num_keys; }
+        
+    private:
+        struct Slot {
+            std::string key;
+            int column=-1;
+        };
+        
+        std::vector<std::pair<std::string,size_t>> keys;
+        std::vector<Slot> slots;
+        size_t mask;
+        uint32_t seed;
+        size_t num_keys;
+        
+        static uint32_t hash(const std::string& key, uint32_t sd) {
+            //fnv-1a
+            uint32_t h = 2166136261u ^ (sd * 16777619u);
+            for (unsigned char c: key) {
+                h ^= c;
+                h *= 16777619u;
+            }
+            return h ^ (h >> 15);
+        }
+        
+        bool try_build(size_t sz, uint32_t sd) {
+            std::vector<Slot> ss(sz);
+            for (const auto& k: keys) {
+                auto& sl = ss[hash(k.first, sd) & (sz-1)];
+                if (sl.column>=0) {
+                    if (sl.key==k.first) {
+                        //repeated key: last column wins
+                        sl.column = k.second;
+                        continue;
+                    }
+                    return false;
+                }
+                sl.key = k.first;
+                sl.column = k.second;
+            }
+            slots.swap(ss);
+            mask = sz-1;
+            seed = sd;
+            return true;
+        }
+};
 
-std::pair<std::string,std::string> prep_tags_binary(const std::map<std::string,size_t>& tags, ElementPtr obj, bool other_tags) {
-    std::vector<std::string> tt(tags.size(),"");
-    
-    tagvector others;
-    size_t len=tags.size()*4;
-    
-    if (!obj->Tags().empty()) {
-        for (const auto& tg:obj->Tags()) {
-            auto it=tags.find(tg.key);
-            if (it!=tags.end()) {
-                if (it->second >= tags.size()) {
-                    Logger::Message() << "tag out of bounds?? " << tg.key << " " << tg.val << "=>" << it->second << "/" << tt.size();
-                    throw std::domain_error("tag out of bounds");
+class CsvRowsPool {
+    public:
+        CsvRowsPool() : bytes(0), limit(256*1024*1024) {}
+        
+        std::string take(size_t min_capacity) {
+            std::string res;
+            {
+                std::lock_guard<std::mutex> lk(mutex);
+                if (!buffers.empty()) {
+                    //the smallest buffer already large enough, or else
+                    //the largest
+                    size_t best=0;
+                    for (size_t i=1; i < buffers.size(); i++) {
+                        size_t cap = buffers[i].capacity();
+                        size_t best_cap = buffers[best].capacity();
+                        if ((best_cap >= min_capacity) ? ((cap >= min_capacity) && (cap < best_cap)) : (cap > best_cap)) {
+                            best=i;
+                        }
+                    }
+                    res.swap(buffers[best]);
+                    std::swap(buffers[best], buffers.back());
+                    buffers.pop_back();
+                    bytes -= res.capacity();
                 }
-                tt.at(it->second)=tg.val;
-                len+=tg.val.size();
-            } else if (other_tags) {
-                others.push_back(tg);
             }
+            if (res.capacity() < min_capacity) {
+                res.reserve(min_capacity);
+            }
+            return res;
         }
-    }
-    
-    std::string out(len,0);
-    size_t pos=0;
-    for (const auto& t:tt) {
-        if (t.empty()) {
-            pos=write_int32(out,pos,-1);
-        } else {
-            pos=write_int32(out,pos,t.size());
-            pos=_write_data(out,pos,t);
+        
+        void put(std::string& data) {
+            size_t cap = data.capacity();
+            if (cap < 64*1024) { return; }
+            
+            std::lock_guard<std::mutex> lk(mutex);
+            if ((bytes + cap) > limit) { return; }
+            data.clear();
+            buffers.push_back(std::string());
+            buffers.back().swap(data);
+            bytes += cap;
         }
-    }
-    
-    std::string hstore;
-    if (other_tags) {
-        hstore=pack_hstoretags_binary(others);
-    }
-    return std::make_pair(out,hstore);
-}
         
+        void set_limit(size_t limit_) {
+            std::lock_guard<std::mutex> lk(mutex);
+            limit = limit_;
+            while ((bytes > limit) && (!buffers.empty())) {
+                bytes -= buffers.front().capacity();
+                buffers.erase(buffers.begin());
+            }
+        }
+        
+        size_t size() {
+            std::lock_guard<std::mutex> lk(mutex);
+            return bytes;
+        }
+        
+    private:
+        std::mutex mutex;
+        std::vector<std::string> buffers;
+        size_t bytes;
+        size_t limit;
+};
 
+CsvRowsPool& csvrows_pool() {
+    static CsvRowsPool pool;
+    return pool;
+}
 
-std::string as_hex(const std::string& str) {
-    std::stringstream ss;
-    for (unsigned char c : str) {
-        ss << std::hex << std::setfill('0') << std::setw(2) << (size_t) c;
-    }
-
-    return ss.str();
+void set_csvrows_pool_limit(size_t limit) {
+    csvrows_pool().set_limit(limit);
+}
 
+size_t csvrows_pool_size() {
+    return csvrows_pool().size();
 }
 
 CsvRows::CsvRows(bool is_binary_) : _is_binary(is_binary_) {
-    data.reserve(1024*1024);
+    data = csvrows_pool().take(256*1024);
     poses.reserve(1000);
     if (_is_binary) {
         data += std::string("PGCOPY\n\xff\r\n\x00\x00\x00\x00\x00\x00\x00\x00\x00",19);
     }
 }
     
-void CsvRows::add(const std::string row) {
+CsvRows::~CsvRows() {
+    csvrows_pool().put(data);
+}
+
+void CsvRows::add(const std::string& row) {
     if ((row.size() + data.size()) > data.capacity()) {
-        data.reserve(data.capacity()+1024*1024);
+        data.reserve(std::max(data.capacity()*2, row.size()+data.size()));
     }    
     if (poses.size()==poses.capacity()) {
-        poses.reserve(poses.capacity()+1000);
+        poses.reserve(poses.capacity()*2);
     }
     
     if (poses.empty()) { poses.push_back(data.size()); }
@@ -262,6 +333,128 @@ void CsvRows::add(const std::string row) {
     poses.push_back(data.size());
 }
 
+void CsvRows::begin_row(size_t num_fields) {
+    if (poses.empty()) { poses.push_back(data.size()); }
+    size_t pos = data.size();
+    data.resize(pos+2);
+    write_int16(data, pos, num_fields);
+}
+
+void CsvRows::add_null() {
+    size_t pos = data.size();
+    data.resize(pos+4);
+    write_int32(data, pos, -1);
+}
+
+void CsvRows::add_int32(int64 v) {
+    size_t pos = data.size();
+    data.resize(pos+8);
+    pos = write_int32(data, pos, 4);
+    write_int32(data, pos, v);
+}
+
+void CsvRows::add_int64(int64 v) {
+    size_t pos = data.size();
+    data.resize(pos+12);
+    pos = write_int32(data, pos, 8);
+    write_int64(data, pos, v);
+}
+
+void CsvRows::add_double(double v) {
+    size_t pos = data.size();
+    data.resize(pos+12);
+    pos = write_int32(data, pos, 8);
+    write_double(data, pos, v);
+}
+
+void CsvRows::add_field(const char* d, size_t len) {
+    size_t pos = data.size();
+    data.resize(pos+4);
+    write_int32(data, pos, len);
+    data.append(d, len);
+}
+
+size_t CsvRows::begin_field() {
+    size_t pos = data.size();
+    data.resize(pos+4);
+    return pos;
+}
+
+void CsvRows::append_data(const char* d, size_t len) {
+    data.append(d, len);
+}
+
+void CsvRows::end_field(size_t pos) {
+    write_int32(data, pos, data.size()-pos-4);
+}
+
+void CsvRows::end_row() {
+    poses.push_back(data.size());
+}
+
+void CsvRows::begin_text_row() {
+    if (poses.empty()) { poses.push_back(data.size()); }
+}
+
+void CsvRows::text_int(int64 v) {
+    char buf[24];
+    auto r = std::to_chars(buf, buf+24, v);
+    data.append(buf, r.ptr-buf);
+}
+
+void CsvRows::text_double(double v) {
+    //as std::fixed with std::setprecision(1)
+    char buf[64];
+    int n = snprintf(buf, 64, "%.1f", v);
+    if (n < 64) {
+        data.append(buf, n);
+    } else {
+        std::string s(n+1, 0);
+        snprintf(&s[0], n+1, "%.1f", v);
+        data.append(s.data(), n);
+    }
+}
+
+void CsvRows::text_quoted(const std::string& v) {
+    data.push_back(quote);
+    const char* p = v.data();
+    const char* e = p+v.size();
+    while (p < e) {
+        const char* n = (const char*) memchr(p, '\n', e-p);
+        if (!n) {
+            data.append(p, e-p);
+            break;
+        }
+        data.append(p, n-p);
+        data.append("\\n", 2);
+        p = n+1;
+    }
+    data.push_back(quote);
+}
+
+void CsvRows::text_hex(const std::string& v) {
+    size_t pos = data.size();
+    data.resize(pos + 2*v.size());
+    char* out = &data[pos];
+    for (unsigned char c: v) {
+        memcpy(out, hex_pairs.pairs + 2*c, 2);
+        out += 2;
+    }
+}
+
+void CsvRows::text_raw(const std::string& v) {
+    data.append(v);
+}
+
+void CsvRows::text_delim() {
+    data.push_back(delim);
+}
+
+void CsvRows::end_text_row() {
+    data.push_back('\n');
+    poses.push_back(data.size());
+}
+
 std::string CsvRows::at(int i) const {
     if (i<0) { i += size(); }
     if (i >= size()) { throw std::range_error("out of range"); }
@@ -282,6 +475,71 @@ int CsvRows::size() const {
     return poses.size()-1;
 }
 
+std::pair<const char*,size_t> CsvRows::rows_data(bool skip_header) const {
+    if (poses.empty()) { return std::make_pair(data.data(), 0); }
+    
+    size_t p = poses.front();
+    if (skip_header && (!_is_binary)) {
+        p = poses[1];
+    }
+    return std::make_pair(data.data()+p, poses.back()-p);
+}
+
+void CsvRows::append(const CsvRows& other, bool skip_header) {
+    if (other.size()==0) { return; }
+    
+    size_t first=0;
+    if (skip_header && (!_is_binary) && (size()>0)) {
+        first=1;
+    }
+    size_t p = other.poses[first];
+    size_t q = other.poses.back();
+    
+    //drop the binary trailer (the header is 19 bytes)
+    size_t end = poses.empty() ? (_is_binary ? 19 : 0) : poses.back();
+    data.resize(end);
+    if (poses.empty()) { poses.push_back(end); }
+    
+    if ((q-p + data.size()) > data.capacity()) {
+        data.reserve(std::max(data.capacity()*2, q-p+data.size()+2));
+    }
+    data.append(other.data, p, q-p);
+    for (size_t i=first+1; i < other.poses.size(); i++) {
+        poses.push_back(other.poses[i] - p + end);
+    }
+    
+    if (_is_binary) {
+        data += "\xff\xff";
+    }
+}
+
+size_t CsvBlock::table_id(const std::string& tab) {
+    for (size_t i=0; i < names->size(); i++) {
+        if ((*names)[i]==tab) {
+            return i;
+        }
+    }
+    //the names may be shared with other blocks
+    auto nn = std::make_shared<table_names>(*names);
+    nn->push_back(tab);
+    names = nn;
+    return names->size()-1;
+}
+
+std::shared_ptr<CsvBlock> CsvBlock::split(const std::string& tab) {
+    auto res = std::make_shared<CsvBlock>(is_binary, quadtree_, index_, names);
+    res->tiles_ = tiles_;
+    
+    auto it = std::find(names->begin(), names->end(), tab);
+    size_t i = it - names->begin();
+    if ((i < rows_.size()) && rows_[i]) {
+        res->rows_.resize(i+1);
+        res->rows_[i] = std::move(rows_[i]);
+        rows_[i].reset();
+    }
+    return res;
+}
+
 std::vector<std::string> default_table_alloc(ElementPtr ele) {
     
     if (ele->Type() == ElementType::Point) { return {"point"}; }
@@ -290,13 +548,176 @@ std::vector<std::string> default_table_alloc(ElementPtr ele) {
     if (ele->Type() == ElementType::ComplicatedPolygon) { return {"polygon"}; }
     return {};
 }
+
+struct TableIdAllocFunc {
+    std::shared_ptr<const TableIdAlloc> alloc;
+    std::vector<std::string> operator()(ElementPtr ele) const { return alloc->call(ele); }
+};
+
+table_alloc_func make_table_alloc_func(std::shared_ptr<const TableIdAlloc> alloc) {
+    return TableIdAllocFunc{alloc};
+}
+
+std::shared_ptr<const TableIdAlloc> get_table_id_alloc(const table_alloc_func& func) {
+    auto ff = func.target<TableIdAllocFunc>();
+    if (!ff) {
+        return nullptr;
+    }
+    return ff->alloc;
+}
+
+//default_table_alloc by table id
+table_id_alloc_func resolve_default_table_alloc(const table_names& tables) {
+    auto find = [&tables](const std::string& tab) {
+        table_set res;
+        auto it = std::find(tables.begin(), tables.end(), tab);
+        if (it!=tables.end()) {
+            res.set(it-tables.begin());
+        } else {
+            Logger::Message() << "unknown table " << tab;
+        }
+        return res;
+    };
+    table_set point = find("point");
+    table_set line = find("line");
+    table_set polygon = find("polygon");
+    return [point, line, polygon](ElementPtr ele) {
+        switch (ele->Type()) {
+            case ElementType::Point: return point;
+            case ElementType::Linestring: return line;
+            case ElementType::SimplePolygon: return polygon;
+            case ElementType::ComplicatedPolygon: return polygon;
+            default: return table_set();
+        }
+    };
+}
+    
+
+struct prep_geometry_result {
+    std::string geom;
+    std::string rep_point_geom;
+    std::string boundary_line_geom;
+};
+
+
+
+//a column filled from the element (rather than from its tags), with the
+//value to use resolved when the table is constructed
+struct ColumnPlan {
+    enum Value {
+        OsmId,
+        Part,
+        ObjectQuadtree,
+        BlockQuadtree,
+        MinZoom,
+        ZOrder,
+        Layer,
+        Measure,
+        Geometry,
+        RepresentativePointGeometry,
+        BoundaryLineGeometry,
+        Tag,
+        OtherTags,
+        Null
+    };
+    
+    ColumnPlan(size_t column_, Value value_, ColumnType type_) : column(column_), value(value_), type(type_) {}
+    size_t column;
+    Value value;
+    ColumnType type;
+};
+
+enum PlanType {
+    PointPlan,
+    LinePlan,
+    SimplePolygonPlan,
+    ComplicatedPolygonPlan,
+    ComplicatedPolygonPartPlan,
+    NumPlans
+};
+
+struct RowValues {
+    RowValues(int64 osm_id_, int64 quadtree_, int64 block_qt_, std::optional<int64> minzoom_, const prep_geometry_result* geom_)
+        : osm_id(osm_id_), part(0), quadtree(quadtree_), block_qt(block_qt_), minzoom(minzoom_), measure(0), geom(geom_) {}
+    
+    int64 osm_id;
+    int64 part;
+    int64 quadtree;
+    int64 block_qt;
+    std::optional<int64> minzoom;
+    std::optional<int64> zorder;
+    std::optional<int64> layer;
+    
+    //length of linestrings, area of polygons
+    double measure;
+    const prep_geometry_result* geom;
+};
+
+//how to fill each column for an element type, in column order. Columns
+//which don't apply to the type are always null.
+std::vector<ColumnPlan> compile_column_plan(const TableSpec& table_spec, PlanType plan_type) {
+    std::vector<ColumnPlan> plan;
     
+    bool is_point = plan_type==PointPlan;
+    bool is_line = plan_type==LinePlan;
+    bool is_part = plan_type==ComplicatedPolygonPartPlan;
+    
+    for (size_t i=0; i < table_spec.columns.size(); i++) {
+        const auto& col = table_spec.columns[i];
+        size_t sz = plan.size();
+        switch (col.source) {
+            case ColumnSource::OsmId: plan.push_back(ColumnPlan(i, ColumnPlan::OsmId, col.type)); break;
+            case ColumnSource::ObjectQuadtree: plan.push_back(ColumnPlan(i, ColumnPlan::ObjectQuadtree, col.type)); break;
+            case ColumnSource::BlockQuadtree: plan.push_back(ColumnPlan(i, ColumnPlan::BlockQuadtree, col.type)); break;
+            case ColumnSource::MinZoom: plan.push_back(ColumnPlan(i, ColumnPlan::MinZoom, col.type)); break;
+            case ColumnSource::Geometry: plan.push_back(ColumnPlan(i, ColumnPlan::Geometry, col.type)); break;
+            case ColumnSource::RepresentativePointGeometry: plan.push_back(ColumnPlan(i, ColumnPlan::RepresentativePointGeometry, col.type)); break;
+            case ColumnSource::BoundaryLineGeometry: plan.push_back(ColumnPlan(i, ColumnPlan::BoundaryLineGeometry, col.type)); break;
+            case ColumnSource::Part:
+                if (is_part) { plan.push_back(ColumnPlan(i, ColumnPlan::Part, col.type)); }
+                break;
+            case ColumnSource::ZOrder:
+                if (!is_point) { plan.push_back(ColumnPlan(i, ColumnPlan::ZOrder, col.type)); }
+                break;
+            case ColumnSource::Layer:
+                if (!is_point) { plan.push_back(ColumnPlan(i, ColumnPlan::Layer, col.type)); }
+                break;
+            case ColumnSource::Length:
+                if (is_line) { plan.push_back(ColumnPlan(i, ColumnPlan::Measure, col.type)); }
+                break;
+            case ColumnSource::Area:
+                if ((!is_point) && (!is_line)) { plan.push_back(ColumnPlan(i, ColumnPlan::Measure, col.type)); }
+                break;
+            case ColumnSource::Tag: plan.push_back(ColumnPlan(i, ColumnPlan::Tag, col.type)); break;
+            case ColumnSource::OtherTags: plan.push_back(ColumnPlan(i, ColumnPlan::OtherTags, col.type)); break;
+        }
+        if (plan.size()==sz) {
+            plan.push_back(ColumnPlan(i, ColumnPlan::Null, col.type));
+        }
+    }
+    return plan;
+}
 
 class PackCsvBlocksTableBase {
     public:
         virtual std::string header()=0;
-        virtual std::string call(ElementPtr ele, int64 block_qt)=0;
-        virtual std::string call_complicatedpolygon_part(std::shared_ptr<geometry::ComplicatedPolygon> ele, size_t part, int64 block_qt)=0;
+        virtual void add(CsvRows& output, ElementPtr ele, int64 block_qt)=0;
+        virtual void add_complicatedpolygon_part(CsvRows& output, std::shared_ptr<geometry::ComplicatedPolygon> ele, size_t part, int64 block_qt)=0;
+        
+        //tables which can prepare the geometry columns separately, from a
+        //DerivedGeometry shared with the other tables: part is the
+        //complicated polygon part, or -1 for the whole element.
+        //prepare_geometry may be called from any thread.
+        virtual bool prepares_geometry() const { return false; }
+        virtual bool uses_geos() const { return false; }
+        virtual prep_geometry_result prepare_geometry(DerivedGeometry& derived) const = 0;
+        virtual void add_prepared(CsvRows& output, ElementPtr ele, int part, const prep_geometry_result& gg, int64 block_qt) = 0;
+        
+        //count the time and bytes spent encoding other_tags
+        void set_tag_stats(StageCounters* tag_stats_) { tag_stats=tag_stats_; }
+        
+    protected:
+        StageCounters* tag_stats = nullptr;
 };
 
 
@@ -320,7 +741,7 @@ std::string pack_csv_row(const std::vector<std::string>& current) {
 class PackCsvBlocksTable : public PackCsvBlocksTableBase {
     public:
         PackCsvBlocksTable(const TableSpec& table_spec_)
-         : table_spec(table_spec_), othertags_col(-1) {
+         : table_spec(table_spec_), othertags_col(-1), has_geometry(false) {
             
             for (size_t i=0; i<table_spec.columns.size(); i++) {
                 const auto& col = table_spec.columns[i];
@@ -329,17 +750,31 @@ class PackCsvBlocksTable : public PackCsvBlocksTableBase {
                     othertags_col=i;
                 }
                 if (col.source == ColumnSource::Tag) {
-                    tag_cols[col.name] = i;
+                    tag_cols.add(col.name, i);
+                }
+                if (col.source == ColumnSource::Geometry) {
+                    has_geometry=true;
                 }
-                
             }
+            tag_cols.build();
             
-            
-             
+            plans.resize(NumPlans);
+            for (int i=0; i < NumPlans; i++) {
+                plans[i] = compile_column_plan(table_spec, (PlanType) i);
+            }
         }
         
         virtual ~PackCsvBlocksTable() {}
         
+        //the text format prepares its geometries in add, so
+        //prepares_geometry is false and these are never called
+        prep_geometry_result prepare_geometry(DerivedGeometry&) const {
+            throw std::domain_error("PackCsvBlocksTable doesn't prepare geometries separately");
+        }
+        void add_prepared(CsvRows&, ElementPtr, int, const prep_geometry_result&, int64) {
+            throw std::domain_error("PackCsvBlocksTable doesn't prepare geometries separately");
+        }
+        
         std::string header() {
             
             std::vector<std::string> current(table_spec.columns.size());
@@ -352,311 +787,271 @@ class PackCsvBlocksTable : public PackCsvBlocksTableBase {
             
         }
         
-        std::string call(ElementPtr ele, int64 block_qt) {
+        void add(CsvRows& output, ElementPtr ele, int64 block_qt) {
             if (!ele) { throw std::domain_error("??"); }
             
-            std::vector<std::string> res(table_spec.columns.size());
-            
             if (ele->Type() == ElementType::Point) {
                 auto pt = std::dynamic_pointer_cast<geometry::Point>(ele);
-                populate_point(pt, block_qt, res);
+                populate_point(pt, block_qt, output);
             } else if (ele->Type() == ElementType::Linestring) {
                 auto ln = std::dynamic_pointer_cast<geometry::Linestring>(ele);
-                populate_line(ln, block_qt, res);
+                populate_line(ln, block_qt, output);
             } else if (ele->Type() == ElementType::SimplePolygon) {
                 auto py = std::dynamic_pointer_cast<geometry::SimplePolygon>(ele);
-                populate_simplepolygon(py, block_qt, res);
+                populate_simplepolygon(py, block_qt, output);
             } else if (ele->Type() == ElementType::ComplicatedPolygon) {
                 auto py = std::dynamic_pointer_cast<geometry::ComplicatedPolygon>(ele);
-                populate_complicatedpolygon(py, block_qt, res);
+                populate_complicatedpolygon(py, block_qt, output);
+            } else {
+                //as before: a row of empty fields
+                output.begin_text_row();
+                for (size_t i=1; i < table_spec.columns.size(); i++) {
+                    output.text_delim();
+                }
+                output.end_text_row();
             }
-            return pack_csv_row(res);
-            
         }
         
-        std::string call_complicatedpolygon_part(std::shared_ptr<geometry::ComplicatedPolygon> ele, size_t part, int64 block_qt) {
+        void add_complicatedpolygon_part(CsvRows& output, std::shared_ptr<geometry::ComplicatedPolygon> ele, size_t part, int64 block_qt) {
             if (!ele) { throw std::domain_error("??"); }
-            
-            std::vector<std::string> res(table_spec.columns.size());
-            populate_complicatedpolygon_part(ele, part, block_qt, res);
-            return pack_csv_row(res);
+            populate_complicatedpolygon_part(ele, part, block_qt, output);
         }
     
     private:
         TableSpec table_spec;
         int othertags_col;
-        std::map<std::string,size_t> tag_cols;
-        
-        
+        TagColumnIndex tag_cols;
+        bool has_geometry;
+        std::vector<std::vector<ColumnPlan>> plans;
         
+        //reused for each row
+        std::vector<const std::string*> tag_values;
+        tagvector other_tags;
         
-        std::string add_tags(const tagvector& tags, std::vector<std::string>& current) {
-            tagvector oo;
+        void find_tags(const tagvector& tags) {
+            tag_values.assign(table_spec.columns.size(), nullptr);
+            other_tags.clear();
             for (const auto& tg: tags) {
-                if (tag_cols.count(tg.key)) {
-                    current[tag_cols.at(tg.key)] = text_string(tg.val);
+                int col = tag_cols.find(tg.key);
+                if (col>=0) {
+                    tag_values[col] = &tg.val;
                 } else if (othertags_col>=0) {
-                    oo.push_back(tg);
+                    other_tags.push_back(tg);
                 }
             }
-            
-            if (othertags_col>=0) {
-                return pack_hstoretags(oo);
-            }
-            return "";
         }
-            
-            
         
-        void populate_point(std::shared_ptr<geometry::Point> ele, int64 block_qt, std::vector<std::string>& current) {
-            
-            for (size_t i=0; i < table_spec.columns.size(); i++) {
-                const auto& col = table_spec.columns[i];
-                if (col.source == ColumnSource::OsmId) {
-                    current[i] = std::to_string(ele->Id());
-                } else if (col.source == ColumnSource::ObjectQuadtree) {
-                    current[i] = std::to_string(ele->Quadtree());
-                } else if (col.source == ColumnSource::BlockQuadtree) {
-                    current[i] = std::to_string(block_qt);
-                } else if (col.source == ColumnSource::MinZoom) {
-                    if (ele->MinZoom()) {
-                        current[i] = std::to_string(*ele->MinZoom());
-                    }
-                } else if (col.source == ColumnSource::Geometry) {
-                    current[i] = as_hex(ele->Wkb(true, true));
-                }
-                
-            }
-            
-            if (othertags_col>=0) {
-                current[othertags_col] = add_tags(ele->Tags(), current);
-            } else {
-                add_tags(ele->Tags(), current);
+        //the text format only fills the geometry column: the representative
+        //point and boundary line columns are left empty
+        prep_geometry_result prep_geometry(std::shared_ptr<BaseGeometry> geom) {
+            prep_geometry_result res;
+            if (has_geometry) {
+                res.geom = geom->Wkb(true, true);
             }
-            
-            
+            return res;
         }
         
-        void populate_line(std::shared_ptr<geometry::Linestring> ele, int64 block_qt, std::vector<std::string>& current) {
+        void populate(const std::vector<ColumnPlan>& plan, const RowValues& vals, const tagvector& tags, CsvRows& output) {
+            find_tags(tags);
             
-            for (size_t i=0; i < table_spec.columns.size(); i++) {
-                const auto& col = table_spec.columns[i];
-                if (col.source == ColumnSource::OsmId) {
-                    current[i] = std::to_string(ele->Id());
-                } else if (col.source == ColumnSource::ObjectQuadtree) {
-                    current[i] = std::to_string(ele->Quadtree());
-                } else if (col.source == ColumnSource::BlockQuadtree) {
-                    current[i] = std::to_string(block_qt);
-                } else if (col.source == ColumnSource::MinZoom) {
-                    if (ele->MinZoom()) {
-                        current[i] = std::to_string(*ele->MinZoom());
-                    }
-                } else if (col.source == ColumnSource::ZOrder) {
-                    if (ele->ZOrder() ) {
-                        current[i]=std::to_string(*ele->ZOrder());
-                    }
-                } else if (col.source == ColumnSource::Layer) {
-                    if (ele->Layer() ) {
-                        current[i]=std::to_string(*ele->Layer());
+            output.begin_text_row();
+            for (const auto& cp: plan) {
+                if (cp.column>0) {
+                    output.text_delim();
+                }
+                switch (cp.value) {
+                    case ColumnPlan::OsmId:
+                        output.text_int(vals.osm_id);
+                        break;
+                    case ColumnPlan::Part:
+                        output.text_int(vals.part);
+                        break;
+                    case ColumnPlan::ObjectQuadtree:
+                        output.text_int(vals.quadtree);
+                        break;
+                    case ColumnPlan::BlockQuadtree:
+                        output.text_int(vals.block_qt);
+                        break;
+                    case ColumnPlan::MinZoom:
+                        if (vals.minzoom) { output.text_int(*vals.minzoom); }
+                        break;
+                    case ColumnPlan::ZOrder:
+                        if (vals.zorder) { output.text_int(*vals.zorder); }
+                        break;
+                    case ColumnPlan::Layer:
+                        if (vals.layer) { output.text_int(*vals.layer); }
+                        break;
+                    case ColumnPlan::Measure:
+                        output.text_double(vals.measure);
+                        break;
+                    case ColumnPlan::Geometry:
+                        output.text_hex(vals.geom->geom);
+                        break;
+                    case ColumnPlan::Tag:
+                        if (tag_values[cp.column]) {
+                            output.text_quoted(*tag_values[cp.column]);
+                        }
+                        break;
+                    case ColumnPlan::OtherTags: {
+                        StageTimer tm(tag_stats);
+                        size_t sz = output.data_blob().size();
+                        if (cp.type==ColumnType::Json) {
+                            output.text_raw(pack_jsontags_picojson(other_tags));
+                        } else {
+                            output.text_raw(pack_hstoretags(other_tags));
+                        }
+                        if (tag_stats) { tag_stats->bytes += output.data_blob().size()-sz; }
+                        break;
                     }
-                } else if (col.source == ColumnSource::Length) {
-                    current[i]=double_string(ele->Length(), true);
-                    
-                } else if (col.source == ColumnSource::Geometry) {
-                    current[i] = as_hex(ele->Wkb(true, true));
+                    case ColumnPlan::RepresentativePointGeometry:
+                    case ColumnPlan::BoundaryLineGeometry:
+                    case ColumnPlan::Null:
+                        break;
                 }
-                
-            }
-            
-            if (othertags_col>=0) {
-                current[othertags_col] = add_tags(ele->Tags(), current);
-            } else {
-                add_tags(ele->Tags(), current);
             }
-            
+            output.end_text_row();
+        }
+        
+        void populate_point(std::shared_ptr<geometry::Point> ele, int64 block_qt, CsvRows& output) {
+            auto gg = prep_geometry(ele);
+            RowValues vals(ele->Id(), ele->Quadtree(), block_qt, ele->MinZoom(), &gg);
+            populate(plans[PointPlan], vals, ele->Tags(), output);
+        }
         
+        void populate_line(std::shared_ptr<geometry::Linestring> ele, int64 block_qt, CsvRows& output) {
+            auto gg = prep_geometry(ele);
+            RowValues vals(ele->Id(), ele->Quadtree(), block_qt, ele->MinZoom(), &gg);
+            vals.zorder = ele->ZOrder();
+            vals.layer = ele->Layer();
+            vals.measure = ele->Length();
+            populate(plans[LinePlan], vals, ele->Tags(), output);
         }
                 
-        void populate_simplepolygon(std::shared_ptr<geometry::SimplePolygon> ele, int64 block_qt, std::vector<std::string>& current) {
-            
-            for (size_t i=0; i < table_spec.columns.size(); i++) {
-                const auto& col = table_spec.columns[i];
-                if (col.source == ColumnSource::OsmId) {
-                    current[i] = std::to_string(ele->Id());
-                } else if (col.source == ColumnSource::ObjectQuadtree) {
-                    current[i] = std::to_string(ele->Quadtree());
-                } else if (col.source == ColumnSource::BlockQuadtree) {
-                    current[i] = std::to_string(block_qt);
-                } else if (col.source == ColumnSource::MinZoom) {
-                    if (ele->MinZoom()) {
-                        current[i] = std::to_string(*ele->MinZoom());
-                    }
-                } else if (col.source == ColumnSource::ZOrder) {
-                    if (ele->ZOrder()) {
-                        current[i]=std::to_string(*ele->ZOrder());
-                    }
-                } else if (col.source == ColumnSource::Layer) {
-                    if (ele->Layer()) {
-                        current[i]=std::to_string(*ele->Layer());
-                    }
-                } else if (col.source == ColumnSource::Area) {
-                    current[i]=double_string(ele->Area(), true);
-                    
-                } else if (col.source == ColumnSource::Geometry) {
-                    current[i] = as_hex(ele->Wkb(true, true));
-                }
-                
-            }
-            
-            if (othertags_col>=0) {
-                current[othertags_col] = add_tags(ele->Tags(), current);
-            } else {
-                add_tags(ele->Tags(), current);
-            }
-            
-            
+        void populate_simplepolygon(std::shared_ptr<geometry::SimplePolygon> ele, int64 block_qt, CsvRows& output) {
+            auto gg = prep_geometry(ele);
+            RowValues vals(ele->Id(), ele->Quadtree(), block_qt, ele->MinZoom(), &gg);
+            vals.zorder = ele->ZOrder();
+            vals.layer = ele->Layer();
+            vals.measure = ele->Area();
+            populate(plans[SimplePolygonPlan], vals, ele->Tags(), output);
         }
-                
-        void populate_complicatedpolygon(std::shared_ptr<geometry::ComplicatedPolygon> ele, int64 block_qt, std::vector<std::string>& current) {
-            
-            for (size_t i=0; i < table_spec.columns.size(); i++) {
-                const auto& col = table_spec.columns[i];
-                if (col.source == ColumnSource::OsmId) {
-                    current[i] = std::to_string(-1*ele->Id());
-                } else if (col.source == ColumnSource::Part) {
-                    //current[i] = std::to_string(ele->Part());
-                }else if (col.source == ColumnSource::ObjectQuadtree) {
-                    current[i] = std::to_string(ele->Quadtree());
-                } else if (col.source == ColumnSource::BlockQuadtree) {
-                    current[i] = std::to_string(block_qt);
-                } else if (col.source == ColumnSource::MinZoom) {
-                    if (ele->MinZoom()) {
-                        current[i] = std::to_string(*ele->MinZoom());
-                    }
-                } else if (col.source == ColumnSource::ZOrder) {
-                    if (ele->ZOrder()) {
-                        current[i]=std::to_string(*ele->ZOrder());
-                    }
-                } else if (col.source == ColumnSource::Layer) {
-                    if (ele->Layer()) {
-                        current[i]=std::to_string(*ele->Layer());
-                    }
-                } else if (col.source == ColumnSource::Area) {
-                    current[i]=double_string(ele->Area(), true);
-                    
-                } else if (col.source == ColumnSource::Geometry) {
-                    current[i] = as_hex(ele->Wkb(true, true));
-                }
-                
-            }
-            
-            if (othertags_col>=0) {
-                current[othertags_col] = add_tags(ele->Tags(), current);
-            } else {
-                add_tags(ele->Tags(), current);
-            }
-            
+        
+        void populate_complicatedpolygon(std::shared_ptr<geometry::ComplicatedPolygon> ele, int64 block_qt, CsvRows& output) {
+            auto gg = prep_geometry(ele);
+            RowValues vals(-1*ele->Id(), ele->Quadtree(), block_qt, ele->MinZoom(), &gg);
+            vals.zorder = ele->ZOrder();
+            vals.layer = ele->Layer();
+            vals.measure = ele->Area();
+            populate(plans[ComplicatedPolygonPlan], vals, ele->Tags(), output);
         }
-            
-        void populate_complicatedpolygon_part(std::shared_ptr<geometry::ComplicatedPolygon> ele, size_t part, int64 block_qt, std::vector<std::string>& current) {
-            
-            for (size_t i=0; i < table_spec.columns.size(); i++) {
-                const auto& col = table_spec.columns[i];
-                if (col.source == ColumnSource::OsmId) {
-                    current[i] = std::to_string(-1*ele->Id());
-                } else if (col.source == ColumnSource::Part) {
-                    current[i] = std::to_string(part);
-                }else if (col.source == ColumnSource::ObjectQuadtree) {
-                    current[i] = std::to_string(ele->Quadtree());
-                } else if (col.source == ColumnSource::BlockQuadtree) {
-                    current[i] = std::to_string(block_qt);
-                } else if (col.source == ColumnSource::MinZoom) {
-                    if (ele->MinZoom()) {
-                        current[i] = std::to_string(*ele->MinZoom());
-                    }
-                } else if (col.source == ColumnSource::ZOrder) {
-                    if (ele->ZOrder()) {
-                        current[i]=std::to_string(*ele->ZOrder());
-                    }
-                } else if (col.source == ColumnSource::Layer) {
-                    if (ele->Layer()) {
-                        current[i]=std::to_string(*ele->Layer());
-                    }
-                } else if (col.source == ColumnSource::Area) {
-                    
-                    current[i]=double_string(ele->Parts().at(part).area, true);
-                    
-                } else if (col.source == ColumnSource::Geometry) {
-                    auto w = geometry::polygon_part_wkb(ele->Parts().at(part), true, true);
-                    current[i] = as_hex(w);
-                }
-                
-            }
-            
-            if (othertags_col>=0) {
-                current[othertags_col] = add_tags(ele->Tags(), current);
-            } else {
-                add_tags(ele->Tags(), current);
+        
+        void populate_complicatedpolygon_part(std::shared_ptr<geometry::ComplicatedPolygon> ele, size_t part, int64 block_qt, CsvRows& output) {
+            prep_geometry_result gg;
+            if (has_geometry) {
+                gg.geom = geometry::polygon_part_wkb(ele->Parts().at(part), true, true);
             }
-            
+            RowValues vals(-1*ele->Id(), ele->Quadtree(), block_qt, ele->MinZoom(), &gg);
+            vals.part = part;
+            vals.zorder = ele->ZOrder();
+            vals.layer = ele->Layer();
+            vals.measure = ele->Parts().at(part).area;
+            populate(plans[ComplicatedPolygonPartPlan], vals, ele->Tags(), output);
         }
         
 };
 
-std::string pack_pg_int(ColumnType ty, int64 v) {
+void add_pg_int(CsvRows& output, ColumnType ty, int64 v) {
     if (ty==ColumnType::BigInteger) {
-        std::string o(8,'\0');
-        write_int64(o, 0, v);
-        return o;
+        output.add_int64(v);
     } else if (ty==ColumnType::Integer) {
-        std::string o(4,'\0');
-        write_int32(o, 0, v);
-        return o;
+        output.add_int32(v);
+    } else {
+        throw std::domain_error("wrong type?");
     }
-    throw std::domain_error("wrong type?");
-    return "";
 }
         
-std::string pack_pg_double(ColumnType ty, int64 v) {
+void add_pg_double(CsvRows& output, ColumnType ty, int64 v) {
     if (ty==ColumnType::Double) {
-        std::string o(8,'\0');
-        write_double(o, 0, v);
-        return o;
+        output.add_double(v);
+    } else {
+        throw std::domain_error("wrong type?");
     }
-    throw std::domain_error("wrong type?");
-    return "";
 }
 
-std::string pack_pgbinary_row(const std::vector<std::pair<bool,std::string>>& fields) {
-    size_t tl = 2 + 4*fields.size();
-    for (const auto& f: fields) { tl+=f.second.size(); }
-    
-    size_t pos=0;
-    std::string data(tl,'\0');
-    
-    pos=write_int16(data, pos, fields.size());
-    
+
+void append_int32(CsvRows& output, int32_t v) {
+    char b[4] = {(char) ((v>>24)&255), (char) ((v>>16)&255), (char) ((v>>8)&255), (char) (v&255)};
+    output.append_data(b, 4);
+}
+
+//as read by hstore_recv: the number of pairs, then the length and data of
+//each key and value
+void add_hstore_field(CsvRows& output, const std::vector<const Tag*>& tags) {
+    size_t pos = output.begin_field();
+    append_int32(output, tags.size());
+    for (const auto* tg: tags) {
+        append_int32(output, tg->key.size());
+        output.append_data(tg->key.data(), tg->key.size());
+        append_int32(output, tg->val.size());
+        output.append_data(tg->val.data(), tg->val.size());
+    }
+    output.end_field(pos);
+}
+
+void append_json_string(CsvRows& output, const std::string& val) {
+    static const char* hex = "0123456789abcdef";
     
-    for (const auto& f: fields) {
-        if (f.first==false) {
-            //null
-            pos = write_int32(data, pos, -1);
+    output.append_data("\"", 1);
+    size_t start=0;
+    for (size_t i=0; i < val.size(); i++) {
+        unsigned char c = val[i];
+        if ((c >= 0x20) && (c != '"') && (c != '\\')) {
+            continue;
+        }
+        output.append_data(val.data()+start, i-start);
+        start = i+1;
+        
+        if (c=='"') {
+            output.append_data("\\\"", 2);
+        } else if (c=='\\') {
+            output.append_data("\\\\", 2);
+        } else if (c=='\n') {
+            output.append_data("\\n", 2);
+        } else if (c=='\t') {
+            output.append_data("\\t", 2);
+        } else if (c=='\r') {
+            output.append_data("\\r", 2);
         } else {
-            pos = write_int32(data, pos, f.second.size());
-            pos = _write_data(data, pos, f.second);
+            char u[6] = {'\\', 'u', '0', '0', hex[c>>4], hex[c&15]};
+            output.append_data(u, 6);
         }
     }
-    if (tl!=pos) { throw std::domain_error("??"); }
-    return data;
+    output.append_data(val.data()+start, val.size()-start);
+    output.append_data("\"", 1);
 }
 
-struct prep_geometry_result {
-    std::string geom;
-    std::string rep_point_geom;
-    std::string boundary_line_geom;
-};
-
+//as read by jsonb_recv: the version byte (1), then the json text
+void add_jsonb_field(CsvRows& output, const std::vector<const Tag*>& tags) {
+    size_t pos = output.begin_field();
+    output.append_data("\x01{", 2);
+    bool first=true;
+    for (const auto* tg: tags) {
+        if (!first) {
+            output.append_data(", ", 2);
+        }
+        append_json_string(output, tg->key);
+        output.append_data(": ", 2);
+        append_json_string(output, tg->val);
+        first=false;
+    }
+    output.append_data("}", 1);
+    output.end_field(pos);
+}
 
+bool has_derived_geometry(ElementPtr ele) {
+    return (ele->Type() == ElementType::Point) || (ele->Type() == ElementType::Linestring)
+        || (ele->Type() == ElementType::SimplePolygon) || (ele->Type() == ElementType::ComplicatedPolygon);
+}
 
 class PackCsvBlocksTableBinary : public PackCsvBlocksTableBase {
     public:
@@ -671,7 +1066,7 @@ class PackCsvBlocksTableBinary : public PackCsvBlocksTableBase {
                     othertags_col=i;
                 }
                 if (col.source == ColumnSource::Tag) {
-                    tag_cols[col.name] = i;
+                    tag_cols.add(col.name, i);
                 }
                 if (col.source == ColumnSource::Geometry) {
                     has_geometry=true;
@@ -684,390 +1079,258 @@ class PackCsvBlocksTableBinary : public PackCsvBlocksTableBase {
                 }
             }
             
+            tag_cols.build();
             
-             
+            plans.resize(NumPlans);
+            for (int i=0; i < NumPlans; i++) {
+                plans[i] = compile_column_plan(table_spec, (PlanType) i);
+            }
         }
         
         virtual ~PackCsvBlocksTableBinary() {}
         
         std::string header() { throw std::domain_error("not implemeneted"); }
         
-        std::string call(ElementPtr ele, int64 block_qt) {
+        void add(CsvRows& output, ElementPtr ele, int64 block_qt) {
             if (!ele) { throw std::domain_error("??"); }
-            
-            std::vector<std::pair<bool,std::string>> res(table_spec.columns.size());
-            
-            if (ele->Type() == ElementType::Point) {
-                auto pt = std::dynamic_pointer_cast<geometry::Point>(ele);
-                populate_point(pt, block_qt, res);
-            } else if (ele->Type() == ElementType::Linestring) {
-                auto ln = std::dynamic_pointer_cast<geometry::Linestring>(ele);
-                populate_line(ln, block_qt, res);
-            } else if (ele->Type() == ElementType::SimplePolygon) {
-                auto py = std::dynamic_pointer_cast<geometry::SimplePolygon>(ele);
-                populate_simplepolygon(py, block_qt, res);
-            } else if (ele->Type() == ElementType::ComplicatedPolygon) {
-                auto py = std::dynamic_pointer_cast<geometry::ComplicatedPolygon>(ele);
-                populate_complicatedpolygon(py, block_qt, res);
+            if (!has_derived_geometry(ele)) {
+                add_prepared(output, ele, -1, prep_geometry_result(), block_qt);
+                return;
             }
-            return pack_pgbinary_row(res);
-            
+            DerivedGeometry derived(std::dynamic_pointer_cast<BaseGeometry>(ele), -1, validate_geometry, round_geometry);
+            add_prepared(output, ele, -1, prepare_geometry(derived), block_qt);
         }
         
-        std::string call_complicatedpolygon_part(std::shared_ptr<geometry::ComplicatedPolygon> ele, size_t part, int64 block_qt) {
+        void add_complicatedpolygon_part(CsvRows& output, std::shared_ptr<geometry::ComplicatedPolygon> ele, size_t part, int64 block_qt) {
             if (!ele) { throw std::domain_error("??"); }
-            
-            std::vector<std::pair<bool,std::string>> res(table_spec.columns.size());
-            populate_complicatedpolygon_part(ele, part, block_qt, res);
-            return pack_pgbinary_row(res);
+            DerivedGeometry derived(ele, part, validate_geometry, round_geometry);
+            add_prepared(output, ele, part, prepare_geometry(derived), block_qt);
         }
         
-    
-    private:
-        TableSpec table_spec;
-        bool validate_geometry;
-        bool round_geometry;
-        int othertags_col;
-        std::map<std::string,size_t> tag_cols;
-        bool has_geometry;
-        bool has_rep_point;
-        bool has_boundary_line;
+        bool prepares_geometry() const { return true; }
         
+        bool uses_geos() const {
+            return (has_geometry || has_rep_point || has_boundary_line) && (validate_geometry || round_geometry || has_rep_point || has_boundary_line);
+        }
         
-        prep_geometry_result prep_geometry(std::shared_ptr<BaseGeometry> geom) {
+        prep_geometry_result prepare_geometry(DerivedGeometry& derived) const {
             prep_geometry_result res;
             
             if ((!has_geometry) && (!has_rep_point) && (!has_boundary_line)) {
                 return res;
             }
             
+            auto validity = GeometryValidity::Valid;
+            if (validate_geometry) {
+                validity = derived.Validity();
+            }
+            
             if (!round_geometry) {
-                if (geom->Type() == oqt::ElementType::Point) {
-                    res.geom = geom->Wkb(true,true);
+                if (derived.Type() == oqt::ElementType::Point) {
+                    res.geom = derived.Wkb();
                     res.rep_point_geom = res.geom;
                     return res;
                 }
                 
-                if (has_geometry && (!has_rep_point) && (!validate_geometry) && (!has_boundary_line)) {
-                    res.geom = geom->Wkb(true,true);
+                if (has_geometry && (!has_rep_point) && (validity==GeometryValidity::Valid) && (!has_boundary_line)) {
+                    res.geom = derived.Wkb();
                     return res;
                 }
             }
             
-            auto gg = make_geos_geometry(geom, round_geometry);
-            
-            if (validate_geometry) {
-                gg->validate();
-            }
+            bool line_is_boundary = (derived.Type() == oqt::ElementType::Linestring) && (derived.Part() < 0);
+            derived.PrepareGeos(has_geometry || (has_boundary_line && line_is_boundary),
+                has_rep_point, has_boundary_line && !line_is_boundary);
             
             if (has_geometry) {
-                res.geom = gg->Wkb();
+                res.geom = derived.GeosWkb();
             }
             if (has_rep_point) {
-                res.rep_point_geom = gg->PointWkb();
+                res.rep_point_geom = derived.PointWkb();
             }
             if (has_boundary_line) {
-                if (geom->Type() == oqt::ElementType::Linestring) {
-                    res.boundary_line_geom = gg->Wkb();
+                if (line_is_boundary) {
+                    res.boundary_line_geom = derived.GeosWkb();
                 } else {
-                    res.boundary_line_geom = gg->BoundaryLineWkb();
+                    res.boundary_line_geom = derived.BoundaryLineWkb();
                 }
             }
             return res;
         }
-        prep_geometry_result prep_geometry_cp_part(std::shared_ptr<ComplicatedPolygon> geom, size_t part) {
-            prep_geometry_result res;
-            if (!round_geometry) {
-                if ((!has_geometry) && (!has_rep_point) && (!has_boundary_line)) {
-                    return res;
-                }
-                
-                
-                if (has_geometry && (!has_rep_point) && (!validate_geometry) && (!has_boundary_line)) {
-                    res.geom = geom->Wkb(true,true);
-                    return res;
+        
+        void add_prepared(CsvRows& output, ElementPtr ele, int part, const prep_geometry_result& gg, int64 block_qt) {
+            if (part >= 0) {
+                auto py = std::dynamic_pointer_cast<geometry::ComplicatedPolygon>(ele);
+                populate_complicatedpolygon_part(py, part, block_qt, gg, output);
+            } else if (ele->Type() == ElementType::Point) {
+                auto pt = std::dynamic_pointer_cast<geometry::Point>(ele);
+                populate_point(pt, block_qt, gg, output);
+            } else if (ele->Type() == ElementType::Linestring) {
+                auto ln = std::dynamic_pointer_cast<geometry::Linestring>(ele);
+                populate_line(ln, block_qt, gg, output);
+            } else if (ele->Type() == ElementType::SimplePolygon) {
+                auto py = std::dynamic_pointer_cast<geometry::SimplePolygon>(ele);
+                populate_simplepolygon(py, block_qt, gg, output);
+            } else if (ele->Type() == ElementType::ComplicatedPolygon) {
+                auto py = std::dynamic_pointer_cast<geometry::ComplicatedPolygon>(ele);
+                populate_complicatedpolygon(py, block_qt, gg, output);
+            } else {
+                //as before: a row of nulls
+                output.begin_row(table_spec.columns.size());
+                for (size_t i=0; i < table_spec.columns.size(); i++) {
+                    output.add_null();
                 }
+                output.end_row();
             }
-            
-            auto gg = make_geos_geometry_cp_part(geom,part,round_geometry);
-            
-            if (validate_geometry) {
-                gg->validate();
-            }
-            
-            if (has_geometry) {
-                res.geom = gg->Wkb();
-            }
-            if (has_rep_point) {
-                res.rep_point_geom = gg->PointWkb();
-            }
-            if (has_boundary_line) {
-                res.boundary_line_geom = gg->BoundaryLineWkb();
-            }
-            return res;
         }
         
+    
+    private:
+        TableSpec table_spec;
+        bool validate_geometry;
+        bool round_geometry;
+        int othertags_col;
+        TagColumnIndex tag_cols;
+        bool has_geometry;
+        bool has_rep_point;
+        bool has_boundary_line;
+        std::vector<std::vector<ColumnPlan>> plans;
+        
+        //reused for each row
+        std::vector<const std::string*> tag_values;
+        std::vector<const Tag*> other_tags;
         
         
-        std::string add_tags(const tagvector& tags, std::vector<std::pair<bool,std::string>>& current) {
-            tagvector oo;
+        void find_tags(const tagvector& tags) {
+            tag_values.assign(table_spec.columns.size(), nullptr);
+            other_tags.clear();
             for (const auto& tg: tags) {
-                if (tag_cols.count(tg.key)) {
-                    current[tag_cols.at(tg.key)] = std::make_pair(true,tg.val);
+                int col = tag_cols.find(tg.key);
+                if (col>=0) {
+                    tag_values[col] = &tg.val;
                 } else if (othertags_col>=0) {
-                    oo.push_back(tg);
+                    other_tags.push_back(&tg);
                 }
             }
-            
-            if (othertags_col>=0) {
-                return pack_hstoretags_binary(oo);
-            }
-            return "";
         }
-            
-            
         
-        void populate_point(std::shared_ptr<geometry::Point> ele, int64 block_qt, std::vector<std::pair<bool, std::string>>& current) {
-            auto gg = prep_geometry(ele);
-            for (size_t i=0; i < table_spec.columns.size(); i++) {
-                const auto& col = table_spec.columns[i];
-                if (col.source == ColumnSource::OsmId) {
-                    current[i] = std::make_pair(true, pack_pg_int(col.type, ele->Id()));
-                } else if (col.source == ColumnSource::ObjectQuadtree) {
-                    current[i] = std::make_pair(true, pack_pg_int(col.type, ele->Quadtree()));
-                } else if (col.source == ColumnSource::BlockQuadtree) {
-                    current[i] = std::make_pair(true, pack_pg_int(col.type, block_qt));
-                } else if (col.source == ColumnSource::MinZoom) {
-                    if (ele->MinZoom()) {
-                        current[i] = std::make_pair(true, pack_pg_int(col.type, *ele->MinZoom()));
-                    }
-                } else if (col.source == ColumnSource::Geometry) {
-                    if (!gg.geom.empty()) {
-                        current[i] = std::make_pair(true, gg.geom);
-                    }
-                } else if (col.source == ColumnSource::RepresentativePointGeometry) {
-                    if (!gg.rep_point_geom.empty()) {
-                        current[i] = std::make_pair(true, gg.rep_point_geom);
-                    }
-                } else if (col.source == ColumnSource::BoundaryLineGeometry) {
-                    if (!gg.boundary_line_geom.empty()) {
-                        current[i] = std::make_pair(true, gg.boundary_line_geom);
+        void populate(const std::vector<ColumnPlan>& plan, const RowValues& vals, const tagvector& tags, CsvRows& output) {
+            find_tags(tags);
+            
+            output.begin_row(plan.size());
+            for (const auto& cp: plan) {
+                switch (cp.value) {
+                    case ColumnPlan::OsmId:
+                        add_pg_int(output, cp.type, vals.osm_id);
+                        break;
+                    case ColumnPlan::Part:
+                        add_pg_int(output, cp.type, vals.part);
+                        break;
+                    case ColumnPlan::ObjectQuadtree:
+                        add_pg_int(output, cp.type, vals.quadtree);
+                        break;
+                    case ColumnPlan::BlockQuadtree:
+                        add_pg_int(output, cp.type, vals.block_qt);
+                        break;
+                    case ColumnPlan::MinZoom:
+                        add_optional_int(output, cp.type, vals.minzoom);
+                        break;
+                    case ColumnPlan::ZOrder:
+                        add_optional_int(output, cp.type, vals.zorder);
+                        break;
+                    case ColumnPlan::Layer:
+                        add_optional_int(output, cp.type, vals.layer);
+                        break;
+                    case ColumnPlan::Measure:
+                        add_pg_double(output, cp.type, (round_geometry ? (round(vals.measure*10.0)/10.0) : vals.measure));
+                        break;
+                    case ColumnPlan::Geometry:
+                        add_optional_field(output, vals.geom->geom);
+                        break;
+                    case ColumnPlan::RepresentativePointGeometry:
+                        add_optional_field(output, vals.geom->rep_point_geom);
+                        break;
+                    case ColumnPlan::BoundaryLineGeometry:
+                        add_optional_field(output, vals.geom->boundary_line_geom);
+                        break;
+                    case ColumnPlan::Tag:
+                        if (tag_values[cp.column]) {
+                            output.add_field(*tag_values[cp.column]);
+                        } else {
+                            output.add_null();
+                        }
+                        break;
+                    case ColumnPlan::OtherTags: {
+                        StageTimer tm(tag_stats);
+                        size_t sz = output.data_blob().size();
+                        if (cp.type==ColumnType::Json) {
+                            add_jsonb_field(output, other_tags);
+                        } else {
+                            add_hstore_field(output, other_tags);
+                        }
+                        if (tag_stats) { tag_stats->bytes += output.data_blob().size()-sz; }
+                        break;
                     }
+                    case ColumnPlan::Null:
+                        output.add_null();
+                        break;
                 }
-                
             }
-            
-            if (othertags_col>=0) {
-                current[othertags_col] = std::make_pair(true, add_tags(ele->Tags(), current));
+            output.end_row();
+        }
+        
+        static void add_optional_int(CsvRows& output, ColumnType ty, const std::optional<int64>& v) {
+            if (v) {
+                add_pg_int(output, ty, *v);
             } else {
-                add_tags(ele->Tags(), current);
+                output.add_null();
             }
-            
-            
         }
         
-        void populate_line(std::shared_ptr<geometry::Linestring> ele, int64 block_qt, std::vector<std::pair<bool,std::string>>& current) {
-            auto gg = prep_geometry(ele);
-            
-            for (size_t i=0; i < table_spec.columns.size(); i++) {
-                const auto& col = table_spec.columns[i];
-                if (col.source == ColumnSource::OsmId) {
-                    current[i] = std::make_pair(true, pack_pg_int(col.type, ele->Id()));
-                } else if (col.source == ColumnSource::ObjectQuadtree) {
-                    current[i] = std::make_pair(true, pack_pg_int(col.type, ele->Quadtree()));
-                } else if (col.source == ColumnSource::BlockQuadtree) {
-                    current[i] = std::make_pair(true, pack_pg_int(col.type, block_qt));
-                } else if (col.source == ColumnSource::MinZoom) {
-                    if (ele->MinZoom()) {
-                        current[i] = std::make_pair(true, pack_pg_int(col.type, *ele->MinZoom()));
-                    }
-                } else if (col.source == ColumnSource::ZOrder) {
-                    if (ele->ZOrder()) {
-                        current[i]=std::make_pair(true, pack_pg_int(col.type, *ele->ZOrder()));
-                    }
-                } else if (col.source == ColumnSource::Layer) {
-                    if (ele->Layer()) {
-                        current[i]=std::make_pair(true, pack_pg_int(col.type, *ele->Layer()));
-                    }
-                } else if (col.source == ColumnSource::Length) {
-                    current[i]=std::make_pair(true, pack_pg_double(col.type, (round_geometry ? (round(ele->Length()*10.0)/10.0) : ele->Length())));
-                    
-                } else if (col.source == ColumnSource::Geometry) {
-                    if (!gg.geom.empty()) {
-                        current[i] = std::make_pair(true, gg.geom);
-                    }
-                } else if (col.source == ColumnSource::RepresentativePointGeometry) {
-                    if (!gg.rep_point_geom.empty()) {
-                        current[i] = std::make_pair(true, gg.rep_point_geom);
-                    }
-                } else if (col.source == ColumnSource::BoundaryLineGeometry) {
-                    if (!gg.boundary_line_geom.empty()) {
-                        current[i] = std::make_pair(true, gg.boundary_line_geom);
-                    }
-                }
-                
-            }
-            
-            if (othertags_col>=0) {
-                current[othertags_col] = std::make_pair(true, add_tags(ele->Tags(), current));
+        static void add_optional_field(CsvRows& output, const std::string& v) {
+            if (v.empty()) {
+                output.add_null();
             } else {
-                add_tags(ele->Tags(), current);
+                output.add_field(v);
             }
-            
+        }
         
+        void populate_point(std::shared_ptr<geometry::Point> ele, int64 block_qt, const prep_geometry_result& gg, CsvRows& output) {
+            RowValues vals(ele->Id(), ele->Quadtree(), block_qt, ele->MinZoom(), &gg);
+            populate(plans[PointPlan], vals, ele->Tags(), output);
+        }
+        
+        void populate_line(std::shared_ptr<geometry::Linestring> ele, int64 block_qt, const prep_geometry_result& gg, CsvRows& output) {
+            RowValues vals(ele->Id(), ele->Quadtree(), block_qt, ele->MinZoom(), &gg);
+            vals.zorder = ele->ZOrder();
+            vals.layer = ele->Layer();
+            vals.measure = ele->Length();
+            populate(plans[LinePlan], vals, ele->Tags(), output);
         }
                 
-        void populate_simplepolygon(std::shared_ptr<geometry::SimplePolygon> ele, int64 block_qt, std::vector<std::pair<bool,std::string>>& current) {
-            auto gg = prep_geometry(ele);
-            for (size_t i=0; i < table_spec.columns.size(); i++) {
-                const auto& col = table_spec.columns[i];
-                if (col.source == ColumnSource::OsmId) {
-                    current[i] = std::make_pair(true, pack_pg_int(col.type, ele->Id()));
-                } else if (col.source == ColumnSource::ObjectQuadtree) {
-                    current[i] = std::make_pair(true, pack_pg_int(col.type, ele->Quadtree()));
-                } else if (col.source == ColumnSource::BlockQuadtree) {
-                    current[i] = std::make_pair(true, pack_pg_int(col.type, block_qt));
-                } else if (col.source == ColumnSource::MinZoom) {
-                    if (ele->MinZoom()) {
-                        current[i] = std::make_pair(true, pack_pg_int(col.type, *ele->MinZoom()));
-                    }
-                } else if (col.source == ColumnSource::ZOrder) {
-                    if (ele->ZOrder()) {
-                        current[i]=std::make_pair(true, pack_pg_int(col.type, *ele->ZOrder()));
-                    }
-                } else if (col.source == ColumnSource::Layer) {
-                    if (ele->Layer()) {
-                        current[i]=std::make_pair(true, pack_pg_int(col.type, *ele->Layer()));
-                    }
-                } else if (col.source == ColumnSource::Area) {
-                    current[i]=std::make_pair(true, pack_pg_double(col.type, (round_geometry ? (round(ele->Area()*10.0)/10.0) : ele->Area())));
-                    
-                } else if (col.source == ColumnSource::Geometry) {
-                    if (!gg.geom.empty()) {
-                        current[i] = std::make_pair(true, gg.geom);
-                    }
-                } else if (col.source == ColumnSource::RepresentativePointGeometry) {
-                    if (!gg.rep_point_geom.empty()) {
-                        current[i] = std::make_pair(true, gg.rep_point_geom);
-                    }
-                } else if (col.source == ColumnSource::BoundaryLineGeometry) {
-                    if (!gg.boundary_line_geom.empty()) {
-                        current[i] = std::make_pair(true, gg.boundary_line_geom);
-                    }
-                }
-                
-            }
-            
-            if (othertags_col>=0) {
-                current[othertags_col] = std::make_pair(true, add_tags(ele->Tags(), current));
-            } else {
-                add_tags(ele->Tags(), current);
-            }
-            
-            
-        }   
-        void populate_complicatedpolygon(std::shared_ptr<geometry::ComplicatedPolygon> ele, int64 block_qt, std::vector<std::pair<bool,std::string>>& current) {
-            auto gg = prep_geometry(ele);
-            for (size_t i=0; i < table_spec.columns.size(); i++) {
-                const auto& col = table_spec.columns[i];
-                if (col.source == ColumnSource::OsmId) {
-                    current[i] = std::make_pair(true, pack_pg_int(col.type, -1*ele->Id()));
-                } else if (col.source == ColumnSource::Part) {
-                    //current[i] = std::make_pair(true, pack_pg_int(col.type, ele->Part()));
-                }else if (col.source == ColumnSource::ObjectQuadtree) {
-                    current[i] = std::make_pair(true, pack_pg_int(col.type, ele->Quadtree()));
-                } else if (col.source == ColumnSource::BlockQuadtree) {
-                    current[i] = std::make_pair(true, pack_pg_int(col.type, block_qt));
-                } else if (col.source == ColumnSource::MinZoom) {
-                    if (ele->MinZoom()) {
-                        current[i] = std::make_pair(true, pack_pg_int(col.type, *ele->MinZoom()));
-                    }
-                } else if (col.source == ColumnSource::ZOrder) {
-                    if (ele->ZOrder()) {
-                        current[i]=std::make_pair(true, pack_pg_int(col.type, *ele->ZOrder()));
-                    }
-                } else if (col.source == ColumnSource::Layer) {
-                    if (ele->Layer()) {
-                        current[i]=std::make_pair(true, pack_pg_int(col.type, *ele->Layer()));
-                    }
-                } else if (col.source == ColumnSource::Area) {
-                    current[i]=std::make_pair(true, pack_pg_double(col.type, (round_geometry ? (round(ele->Area()*10.0)/10.0) : ele->Area())));
-                    
-                } else if (col.source == ColumnSource::Geometry) {
-                    if (!gg.geom.empty()) {
-                        current[i] = std::make_pair(true, gg.geom);
-                    }
-                } else if (col.source == ColumnSource::RepresentativePointGeometry) {
-                    if (!gg.rep_point_geom.empty()) {
-                        current[i] = std::make_pair(true, gg.rep_point_geom);
-                    }
-                    
-                } else if (col.source == ColumnSource::BoundaryLineGeometry) {
-                    if (!gg.boundary_line_geom.empty()) {
-                        current[i] = std::make_pair(true, gg.boundary_line_geom);
-                    }
-                }
-                
-            }
-            
-            if (othertags_col>=0) {
-                current[othertags_col] = std::make_pair(true, add_tags(ele->Tags(), current));
-            } else {
-                add_tags(ele->Tags(), current);
-            }
-            
+        void populate_simplepolygon(std::shared_ptr<geometry::SimplePolygon> ele, int64 block_qt, const prep_geometry_result& gg, CsvRows& output) {
+            RowValues vals(ele->Id(), ele->Quadtree(), block_qt, ele->MinZoom(), &gg);
+            vals.zorder = ele->ZOrder();
+            vals.layer = ele->Layer();
+            vals.measure = ele->Area();
+            populate(plans[SimplePolygonPlan], vals, ele->Tags(), output);
         }
         
-        void populate_complicatedpolygon_part(std::shared_ptr<geometry::ComplicatedPolygon> ele, size_t part, int64 block_qt, std::vector<std::pair<bool,std::string>>& current) {
-            auto gg = prep_geometry_cp_part(ele,part);
-            for (size_t i=0; i < table_spec.columns.size(); i++) {
-                const auto& col = table_spec.columns[i];
-                if (col.source == ColumnSource::OsmId) {
-                    current[i] = std::make_pair(true, pack_pg_int(col.type, -1*ele->Id()));
-                } else if (col.source == ColumnSource::Part) {
-                    current[i] = std::make_pair(true, pack_pg_int(col.type, part));
-                }else if (col.source == ColumnSource::ObjectQuadtree) {
-                    current[i] = std::make_pair(true, pack_pg_int(col.type, ele->Quadtree()));
-                } else if (col.source == ColumnSource::BlockQuadtree) {
-                    current[i] = std::make_pair(true, pack_pg_int(col.type, block_qt));
-                } else if (col.source == ColumnSource::MinZoom) {
-                    if (ele->MinZoom()) {
-                        current[i] = std::make_pair(true, pack_pg_int(col.type, *ele->MinZoom()));
-                    }
-                } else if (col.source == ColumnSource::ZOrder) {
-                    if (ele->ZOrder()) {
-                        current[i]=std::make_pair(true, pack_pg_int(col.type, *ele->ZOrder()));
-                    }
-                } else if (col.source == ColumnSource::Layer) {
-                    if (ele->Layer()) {
-                        current[i]=std::make_pair(true, pack_pg_int(col.type, *ele->Layer()));
-                    }
-                } else if (col.source == ColumnSource::Area) {
-                    double a = ele->Parts().at(part).area;
-                    current[i]=std::make_pair(true, pack_pg_double(col.type, (round_geometry ? (round(a*10.0)/10.0) : a)));
-                    
-                } else if (col.source == ColumnSource::Geometry) {
-                    if (!gg.geom.empty()) {
-                        current[i] = std::make_pair(true, gg.geom);
-                    }
-                } else if (col.source == ColumnSource::RepresentativePointGeometry) {
-                    if (!gg.rep_point_geom.empty()) {
-                        current[i] = std::make_pair(true, gg.rep_point_geom);
-                    }
-                } else if (col.source == ColumnSource::BoundaryLineGeometry) {
-                    if (!gg.boundary_line_geom.empty()) {
-                        current[i] = std::make_pair(true, gg.boundary_line_geom);
-                    }
-                }
-                
-            }
-            
-            if (othertags_col>=0) {
-                current[othertags_col] = std::make_pair(true, add_tags(ele->Tags(), current));
-            } else {
-                add_tags(ele->Tags(), current);
-            }
-            
+        void populate_complicatedpolygon(std::shared_ptr<geometry::ComplicatedPolygon> ele, int64 block_qt, const prep_geometry_result& gg, CsvRows& output) {
+            RowValues vals(-1*ele->Id(), ele->Quadtree(), block_qt, ele->MinZoom(), &gg);
+            vals.zorder = ele->ZOrder();
+            vals.layer = ele->Layer();
+            vals.measure = ele->Area();
+            populate(plans[ComplicatedPolygonPlan], vals, ele->Tags(), output);
+        }
+        
+        void populate_complicatedpolygon_part(std::shared_ptr<geometry::ComplicatedPolygon> ele, size_t part, int64 block_qt, const prep_geometry_result& gg, CsvRows& output) {
+            RowValues vals(-1*ele->Id(), ele->Quadtree(), block_qt, ele->MinZoom(), &gg);
+            vals.part = part;
+            vals.zorder = ele->ZOrder();
+            vals.layer = ele->Layer();
+            vals.measure = ele->Parts().at(part).area;
+            populate(plans[ComplicatedPolygonPartPlan], vals, ele->Tags(), output);
         }
             
 };            
@@ -1078,82 +1341,321 @@ class PackCsvBlocksTableBinary : public PackCsvBlocksTableBase {
 
 class PackCsvBlocksImpl : public PackCsvBlocks {
     public:
-        PackCsvBlocksImpl(const PackCsvBlocks::tagspec& tags, bool with_header_, bool binary_format_, table_alloc_func alloc_func_, bool split_multipolygons_, bool validate_geometry_, bool round_geometry_)
-            : with_header(with_header_), binary_format(binary_format_),alloc_func(alloc_func_), split_multipolygons(split_multipolygons_),validate_geometry(validate_geometry_), round_geometry(round_geometry_) {
-            
-            if (!alloc_func) {
-                alloc_func = default_table_alloc;
+        PackCsvBlocksImpl(const PackCsvBlocks::tagspec& tags, bool with_header_, bool binary_format_, table_alloc_func alloc_func_, bool split_multipolygons_, bool validate_geometry_, bool round_geometry_,
+            std::shared_ptr<WorkStealingPool> geometry_pool_, size_t geometry_pool_min_points_, block_table_alloc_func block_alloc_, std::shared_ptr<PostgisStats> stats_)
+            : with_header(with_header_), binary_format(binary_format_),alloc_func(alloc_func_), split_multipolygons(split_multipolygons_),validate_geometry(validate_geometry_), round_geometry(round_geometry_),
+              geometry_pool(geometry_pool_), geometry_pool_min_points(geometry_pool_min_points_), block_alloc(block_alloc_), stats(stats_) {
+            
+            if (tags.size() > max_tables) {
+                Logger::Message() << "PackCsvBlocks: " << tags.size() << " tables, at most " << max_tables << " allowed";
+                throw std::domain_error("too many tables");
             }
             
+            auto nn = std::make_shared<table_names>();
             for (const auto& ts: tags) {
+                table_ids[ts.table_name] = nn->size();
+                nn->push_back(ts.table_name);
                 if (binary_format) {
-                    tables[ts.table_name] = std::make_shared<PackCsvBlocksTableBinary>(ts,validate_geometry,round_geometry);
+                    tables.push_back(std::make_shared<PackCsvBlocksTableBinary>(ts,validate_geometry,round_geometry));
+                } else {
+                    tables.push_back(std::make_shared<PackCsvBlocksTable>(ts));
+                }
+                if (stats) {
+                    tables.back()->set_tag_stats(&local_stats["tags"][ts.table_name]);
+                    geometry_stats.push_back(&local_stats["geometry"][ts.table_name]);
                 } else {
-                    tables[ts.table_name] = std::make_shared<PackCsvBlocksTable>(ts);
+                    geometry_stats.push_back(nullptr);
                 }
             }
+            names = nn;
+            
+            //allocators which know the table ids avoid building the list
+            //of table names for each element
+            auto fp = alloc_func.target<std::vector<std::string>(*)(ElementPtr)>();
+            if ((!alloc_func) || (fp && (*fp == default_table_alloc))) {
+                id_alloc = resolve_default_table_alloc(*names);
+            } else if (auto ta = get_table_id_alloc(alloc_func)) {
+                id_alloc = ta->resolve(*names);
+            }
         }
         
         virtual ~PackCsvBlocksImpl() {}
         
         std::shared_ptr<CsvBlock> call(PrimitiveBlockPtr block) {
             if (!block) { return nullptr; }
-            auto res = std::make_shared<CsvBlock>(binary_format);
+            if (!stats) {
+                return pack_block(block);
+            }
+            
+            std::shared_ptr<CsvBlock> res;
+            {
+                StageTimer tm(&local_stats["pack"][""]);
+                res = pack_block(block);
+            }
+            for (const auto& rr: res->rows()) {
+                auto& cc = local_stats["pack"][rr.first];
+                cc.rows += rr.second.size() - ((with_header && (rr.second.size()>0)) ? 1 : 0);
+                cc.bytes += rr.second.data_blob().size();
+            }
+            flush_stage_counters(*stats, local_stats);
+            return res;
+        }
+    private:
+        std::shared_ptr<CsvBlock> pack_block(PrimitiveBlockPtr block) {
+            auto res = std::make_shared<CsvBlock>(binary_format, block->Quadtree(), block->Index(), names);
             
+            std::vector<PendingRow> pending;
             
-                    
+            //the geometries derived from each element (or complicated
+            //polygon part) are shared between all its tables
+            std::vector<std::shared_ptr<DerivedGeometry>> derived;
             
-            for (auto obj: block->Objects()) {
-                auto tt = alloc_func(obj);
-                for (const auto& tab: tt) {
-                    if (tables.count(tab)==0) {
-                        if (unknowns.count(tab)==0) {
-                            Logger::Message() << "unknown table " << tab;
-                        } else {
-                            unknowns.insert(tab);
+            std::vector<std::vector<std::string>> block_tables;
+            if (block_alloc) {
+                block_tables = block_alloc(block);
+                if (block_tables.size() != block->Objects().size()) {
+                    Logger::Message() << "block_alloc returned " << block_tables.size() << " results for " << block->Objects().size() << " objects";
+                    throw std::domain_error("block_alloc returned wrong number of results");
+                }
+            }
+            
+            for (size_t obj_idx=0; obj_idx < block->Objects().size(); obj_idx++) {
+                auto obj = block->Objects()[obj_idx];
+                
+                table_set tt;
+                if (block_alloc) {
+                    tt = find_tables(block_tables[obj_idx]);
+                } else if (id_alloc) {
+                    tt = id_alloc(obj);
+                } else {
+                    tt = find_tables(alloc_func(obj));
+                }
+                if (tt.none()) {
+                    continue;
+                }
+                
+                std::shared_ptr<geometry::ComplicatedPolygon> cp;
+                if (split_multipolygons && (obj->Type()==ElementType::ComplicatedPolygon)) {
+                    cp = std::dynamic_pointer_cast<geometry::ComplicatedPolygon>(obj);
+                    if (!cp) {
+                        throw std::domain_error("wrong type");
+                    }
+                }
+                
+                derived.clear();
+                if (has_derived_geometry(obj)) {
+                    auto geom = std::dynamic_pointer_cast<BaseGeometry>(obj);
+                    if (cp) {
+                        for (size_t i=0; i < cp->Parts().size(); i++) {
+                            derived.push_back(std::make_shared<DerivedGeometry>(geom, i, validate_geometry, round_geometry));
                         }
-                        continue;
+                    } else {
+                        derived.push_back(std::make_shared<DerivedGeometry>(geom, -1, validate_geometry, round_geometry));
                     }
+                }
+                
+                for (size_t tab=0; tab < tables.size(); tab++) {
+                    if (!tt.test(tab)) { continue; }
                     
                     auto& output = res->get(tab);
-                    
-                    auto& table = tables.at(tab);
+                    auto& table = tables[tab];
                     
                     if (with_header && (output.size()==0)) {
                         output.add(table->header());
                     }
-                    if (split_multipolygons && (obj->Type()==ElementType::ComplicatedPolygon)) {
-                        auto cp = std::dynamic_pointer_cast<geometry::ComplicatedPolygon>(obj);
-                        if (!cp) {
-                            throw std::domain_error("wrong type");
-                        }
+                    if (cp) {
                         for (size_t i=0; i < cp->Parts().size(); i++) {
-                            output.add(table->call_complicatedpolygon_part(cp, i, block->Quadtree()));
+                            add_row(pending, output, table, geometry_stats[tab], obj, i, derived.at(i), block->Quadtree());
                         }
                         
                     } else {
-                        output.add(table->call(obj, block->Quadtree()));
+                        add_row(pending, output, table, geometry_stats[tab], obj, -1, derived.empty() ? nullptr : derived[0], block->Quadtree());
                     }
                 }
             }           
             
+            //with a geometry pool the rows are written once all the other
+            //geometries in the block have been prepared, waiting for the
+            //expensive ones as they are reached
+            for (auto& pr: pending) {
+                if (pr.result.valid()) {
+                    auto rr = pr.result.get();
+                    if (pr.geom_stats) {
+                        pr.geom_stats->calls++;
+                        pr.geom_stats->seconds += rr.second;
+                    }
+                    pr.table->add_prepared(*pr.output, pr.ele, pr.part, rr.first, block->Quadtree());
+                } else if (pr.prepared) {
+                    pr.table->add_prepared(*pr.output, pr.ele, pr.part, pr.geom, block->Quadtree());
+                } else {
+                    add_direct(*pr.output, pr.table, pr.ele, pr.part, block->Quadtree());
+                }
+            }
+            
             res->finish();
             return res;
         }
-    private:
-        std::map<std::string, std::shared_ptr<PackCsvBlocksTableBase>> tables;
-        bool with_header;
-        bool binary_format;
-        table_alloc_func alloc_func;
+        
+        struct PendingRow {
+            PendingRow(CsvRows* output_, std::shared_ptr<PackCsvBlocksTableBase> table_, StageCounters* geom_stats_, ElementPtr ele_, int part_)
+                : output(output_), table(table_), geom_stats(geom_stats_), ele(ele_), part(part_), prepared(false) {}
+            CsvRows* output;
+            std::shared_ptr<PackCsvBlocksTableBase> table;
+            StageCounters* geom_stats;
+            ElementPtr ele;
+            int part;
+            bool prepared;
+            prep_geometry_result geom;
+            
+            //the geometry, and the seconds taken to prepare it
+            std::future<std::pair<prep_geometry_result,double>> result;
+        };
+        
+        table_set find_tables(const std::vector<std::string>& tt) {
+            table_set result;
+            for (const auto& tab: tt) {
+                auto it = table_ids.find(tab);
+                if (it==table_ids.end()) {
+                    if (unknowns.count(tab)==0) {
+                        Logger::Message() << "unknown table " << tab;
+                        unknowns.insert(tab);
+                    }
+                    continue;
+                }
+                result.set(it->second);
+            }
+            return result;
+        }
+        
+        void add_direct(CsvRows& output, std::shared_ptr<PackCsvBlocksTableBase> table, ElementPtr ele, int part, int64 block_qt) {
+            if (part >= 0) {
+                table->add_complicatedpolygon_part(output, std::dynamic_pointer_cast<geometry::ComplicatedPolygon>(ele), part, block_qt);
+            } else {
+                table->add(output, ele, block_qt);
+            }
+        }
+        
+        static prep_geometry_result prepare_geometry(std::shared_ptr<PackCsvBlocksTableBase> table, DerivedGeometry& derived, StageCounters* geom_stats) {
+            StageTimer tm(geom_stats);
+            return table->prepare_geometry(derived);
+        }
+        
+        void add_row(std::vector<PendingRow>& pending, CsvRows& output, std::shared_ptr<PackCsvBlocksTableBase> table, StageCounters* geom_stats, ElementPtr ele, int part, std::shared_ptr<DerivedGeometry> derived, int64 block_qt) {
+            bool prepare = derived && table->prepares_geometry();
+            
+            if (!geometry_pool) {
+                if (prepare) {
+                    table->add_prepared(output, ele, part, prepare_geometry(table, *derived, geom_stats), block_qt);
+                } else {
+                    add_direct(output, table, ele, part, block_qt);
+                }
+                return;
+            }
+            
+            pending.push_back(PendingRow(&output, table, geom_stats, ele, part));
+            if (!prepare) {
+                return;
+            }
+            
+            if (table->uses_geos() && (num_points(ele, part) >= geometry_pool_min_points)) {
+                //hand the conversion to geos (and any buffer(0) of invalid
+                //polygons) to the pool, so that the rest of the block is
+                //not held up behind it
+                pending.back().result = geometry_pool->submit([table, derived]() {
+                    auto st = std::chrono::steady_clock::now();
+                    auto gg = table->prepare_geometry(*derived);
+                    return std::make_pair(std::move(gg), std::chrono::duration<double>(std::chrono::steady_clock::now()-st).count());
+                });
+            } else {
+                pending.back().geom = prepare_geometry(table, *derived, geom_stats);
+                pending.back().prepared = true;
+            }
+        }
+        
+        static size_t num_points(ElementPtr ele, int part) {
+            if (ele->Type() == ElementType::Linestring) {
+                return std::dynamic_pointer_cast<geometry::Linestring>(ele)->LonLats().size();
+            } else if (ele->Type() == ElementType::SimplePolygon) {
+                return std::dynamic_pointer_cast<geometry::SimplePolygon>(ele)->LonLats().size();
+            } else if (ele->Type() == ElementType::ComplicatedPolygon) {
+                auto cp = std::dynamic_pointer_cast<geometry::ComplicatedPolygon>(ele);
+                size_t np=0;
+                for (size_t i=0; i < cp->Parts().size(); i++) {
+                    if ((part >= 0) && (i != (size_t) part)) { continue; }
+                    const auto& pp = cp->Parts()[i];
+                    np += ringpart_lonlats(pp.outer).size();
+                    for (const auto& inn: pp.inners) {
+                        np += ringpart_lonlats(inn).size();
+                    }
+                }
+                return np;
+            }
+            return 1;
+        }
+        
+
+        std::vector<std::shared_ptr<PackCsvBlocksTableBase>> tables;
+        std::shared_ptr<const table_names> names;
+        std::unordered_map<std::string,size_t> table_ids;
+        bool with_header;
+        bool binary_format;
+        table_alloc_func alloc_func;
         bool split_multipolygons;
         bool validate_geometry;
         bool round_geometry;
+        std::shared_ptr<WorkStealingPool> geometry_pool;
+        size_t geometry_pool_min_points;
+        block_table_alloc_func block_alloc;
+        table_id_alloc_func id_alloc;
         std::set<std::string> unknowns;
+        
+        std::shared_ptr<PostgisStats> stats;
+        stage_counters local_stats;
+        std::vector<StageCounters*> geometry_stats;
 };
 
-std::shared_ptr<PackCsvBlocks> make_pack_csvblocks(const PackCsvBlocks::tagspec& tags, bool with_header, bool binary_format, table_alloc_func alloc_func, bool split_multipolygons, bool validate_geometry, bool round_geometry) {
-    return std::make_shared<PackCsvBlocksImpl>(tags, with_header,binary_format, alloc_func, split_multipolygons,validate_geometry,round_geometry);
+std::shared_ptr<PackCsvBlocks> make_pack_csvblocks(const PackCsvBlocks::tagspec& tags, bool with_header, bool binary_format, table_alloc_func alloc_func, bool split_multipolygons, bool validate_geometry, bool round_geometry,
+    std::shared_ptr<WorkStealingPool> geometry_pool, size_t geometry_pool_min_points, block_table_alloc_func block_alloc,
+    std::shared_ptr<PostgisStats> stats) {
+    return std::make_shared<PackCsvBlocksImpl>(tags, with_header,binary_format, alloc_func, split_multipolygons,validate_geometry,round_geometry, geometry_pool, geometry_pool_min_points, block_alloc, stats);
 }            
+
+PackCsvBlocksBenchmark benchmark_pack_csvblocks(const PackCsvBlocks::tagspec& tags, const std::vector<PrimitiveBlockPtr>& blocks, table_alloc_func table_alloc, bool split_multipolygons, size_t repeats) {
+    PackCsvBlocksBenchmark result;
+    
+    for (bool binary: {false, true}) {
+        auto packer = make_pack_csvblocks(tags, false, binary, table_alloc, split_multipolygons, false, false);
+        
+        size_t num_rows=0;
+        size_t num_bytes=0;
+        auto st = std::chrono::steady_clock::now();
+        for (size_t i=0; i < repeats; i++) {
+            for (const auto& bl: blocks) {
+                auto res = packer->call(bl);
+                for (const auto& rr: res->rows()) {
+                    num_rows += rr.second.size();
+                    num_bytes += rr.second.data_blob().size();
+                }
+            }
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now()-st).count();
+        
+        if (binary) {
+            result.binary_seconds = secs;
+            result.binary_bytes = num_bytes;
+        } else {
+            result.text_seconds = secs;
+            result.text_bytes = num_bytes;
+            result.num_rows = num_rows;
+        }
+    }
+    result.num_blocks = blocks.size()*repeats;
+    
+    Logger::Message() << "packed " << result.num_blocks << " blocks, " << result.num_rows << " rows: text "
+        << std::fixed << std::setprecision(2) << result.text_seconds << "s " << (result.text_bytes/1024/1024) << "mb, binary "
+        << result.binary_seconds << "s " << (result.binary_bytes/1024/1024) << "mb";
+    return result;
+}
             
 
 std::string pack_csv(const CsvRows& rr, const std::string& name) {
@@ -1173,7 +1675,7 @@ void write_csv_block(std::string outfn, std::shared_ptr<CsvBlock> bl) {
         return;
     }
     std::list<PbfTag> ll;
-    for (auto& cc: bl->rows()) {
+    for (const auto& cc: bl->rows()) {
         if (cc.second.size()>0) {
             ll.push_back(PbfTag{1,0,pack_csv(cc.second, cc.first)});
         }
@@ -1190,15 +1692,282 @@ void write_csv_block(std::string outfn, std::shared_ptr<CsvBlock> bl) {
     out.close();
 }
 
+std::string import_journal_tiles(const std::vector<int64>& tiles) {
+    std::stringstream ss;
+    ss << "{";
+    for (size_t i=0; i < tiles.size(); i++) {
+        if (i>0) { ss << ","; }
+        ss << tiles[i];
+    }
+    ss << "}";
+    return ss.str();
+}
+
+void write_import_journal(PGconn* conn, const std::string& journal_table, const std::string& tab, const std::vector<int64>& tiles) {
+    if (tiles.empty()) { return; }
+    
+    std::string tiles_str = import_journal_tiles(tiles);
+    
+    std::string sql = "insert into "+journal_table+" (tab, tile) select $1, unnest($2::bigint[])";
+    const char* vals[2] = {tab.c_str(), tiles_str.c_str()};
+    
+    auto res = PQexecParams(conn, sql.c_str(), 2, nullptr, vals, nullptr, nullptr, 0);
+    int r = PQresultStatus(res);
+    PQclear(res);
+    if (r!=PGRES_COMMAND_OK) {
+        Logger::Message() << "write journal failed [" << tab << "]: " << PQerrorMessage(conn);
+        throw std::domain_error("write journal failed");
+    }
+}
+
+//write_import_journal's query with the values inlined, to be sent with
+//PQsendQuery
+std::string import_journal_sql(PGconn* conn, const std::string& journal_table, const std::string& tab, const std::vector<int64>& tiles) {
+    auto tab_lit = PQescapeLiteral(conn, tab.c_str(), tab.size());
+    if (!tab_lit) {
+        Logger::Message() << "escape literal failed [" << tab << "]: " << PQerrorMessage(conn);
+        throw std::domain_error("escape literal failed");
+    }
+    std::string sql = "insert into "+journal_table+" (tab, tile) select "+tab_lit+", unnest('"+import_journal_tiles(tiles)+"'::bigint[])";
+    PQfreemem(tab_lit);
+    return sql;
+}
+
+std::unordered_set<int64> read_import_journal(PGconn* conn, const std::string& journal_table, const std::string& tab) {
+    std::string sql = "select tile from "+journal_table+" where tab=$1";
+    const char* vals[1] = {tab.c_str()};
+    
+    auto res = PQexecParams(conn, sql.c_str(), 1, nullptr, vals, nullptr, nullptr, 0);
+    if (PQresultStatus(res)!=PGRES_TUPLES_OK) {
+        Logger::Message() << "read journal failed [" << tab << "]: " << PQerrorMessage(conn);
+        PQclear(res);
+        throw std::domain_error("read journal failed");
+    }
+    std::unordered_set<int64> tiles;
+    for (int i=0; i < PQntuples(res); i++) {
+        tiles.insert(std::stoll(PQgetvalue(res, i, 0)));
+    }
+    PQclear(res);
+    if (!tiles.empty()) {
+        Logger::Message() << "resume " << tab << ": skip " << tiles.size() << " committed blocks";
+    }
+    return tiles;
+}
+
+std::string import_journal_table(const std::string& table_prfx) {
+    return table_prfx+"import_journal";
+}
+
+void exec_queries(const std::string& connection_string, const std::vector<std::string>& queries) {
+    auto conn = PQconnectdb(connection_string.c_str());
+    if ((!conn) || (PQstatus(conn)!=CONNECTION_OK)) {
+        Logger::Message() << "connection to postgresql failed [" << connection_string << "]";
+        throw std::domain_error("connection to postgressql failed");
+    }
+    
+    for (const auto& sql: queries) {
+        auto res = PQexec(conn, sql.c_str());
+        int r = PQresultStatus(res);
+        PQclear(res);
+        if (r!=PGRES_COMMAND_OK) {
+            Logger::Message() << sql << " failed: " << PQerrorMessage(conn);
+            PQfinish(conn);
+            throw std::domain_error("query failed");
+        }
+    }
+    PQfinish(conn);
+}
+
+void prepare_import_journal(const std::string& connection_string, const std::string& table_prfx, bool resume) {
+    
+    std::string tab = import_journal_table(table_prfx);
+    std::vector<std::string> sqls;
+    if (!resume) {
+        sqls.push_back("drop table if exists "+tab);
+    }
+    sqls.push_back("create table if not exists "+tab+" (tab text, tile bigint)");
+    
+    exec_queries(connection_string, sqls);
+}
+
+std::string column_type_sql(ColumnType ct) {
+    switch (ct) {
+        case ColumnType::Text: return "text";
+        case ColumnType::BigInteger: return "bigint";
+        case ColumnType::Integer: return "integer";
+        case ColumnType::Double: return "float";
+        case ColumnType::Hstore: return "hstore";
+        case ColumnType::Json: return "jsonb";
+        case ColumnType::TextArray: return "text[]";
+        case ColumnType::Geometry: return "geometry(Geometry,3857)";
+        case ColumnType::PointGeometry: return "geometry(Point,3857)";
+        case ColumnType::LineGeometry: return "geometry(Linestring,3857)";
+        case ColumnType::PolygonGeometry: return "geometry(Polygon,3857)";
+    }
+    throw std::domain_error("unexpected column type");
+}
+
+std::string partition_suffix(int64 key, size_t depth) {
+    std::string res="_qt_";
+    for (size_t i=0; i < depth; i++) {
+        res += (char) ('0' + ((key >> (2*(depth-1-i))) & 3));
+    }
+    return res;
+}
+
+std::string partition_table(const std::string& tab, int64 qt, size_t depth) {
+    if ((depth==0) || (qt<0)) {
+        return tab;
+    }
+    return tab+partition_suffix(qt >> (63-2*depth), depth);
+}
+
+std::vector<std::string> partition_tables(const std::string& tab, size_t depth) {
+    std::vector<std::string> res;
+    if (depth==0) {
+        res.push_back(tab);
+        return res;
+    }
+    for (int64 key=0; key < (1ll << (2*depth)); key++) {
+        res.push_back(tab+partition_suffix(key, depth));
+    }
+    res.push_back(tab+"_qt_default");
+    return res;
+}
+
+std::string partition_column(const TableSpec& spec) {
+    for (const auto& col: spec.columns) {
+        if (col.source==ColumnSource::BlockQuadtree) {
+            return col.name;
+        }
+    }
+    Logger::Message() << "table " << spec.table_name << " has no BlockQuadtree column";
+    throw std::domain_error("partitioned table needs a BlockQuadtree column");
+}
+
+std::vector<std::string> prepare_table_queries(const std::string& table_prfx, const TableSpec& spec, const PostgisWriterOptions& options) {
+    std::string tab = table_prfx+spec.table_name;
+    size_t depth = options.partition_depth;
+    
+    std::vector<std::string> res;
+    if (options.table_mode==TableLoadMode::Create) {
+        std::stringstream ss;
+        //partitioned tables can't be unlogged: only the partitions are
+        ss << "create " << ((options.unlogged && (depth==0)) ? "unlogged " : "") << "table " << tab << " (";
+        for (size_t i=0; i < spec.columns.size(); i++) {
+            if (i>0) { ss << ", "; }
+            ss << '"' << spec.columns[i].name << "\" " << column_type_sql(spec.columns[i].type);
+        }
+        ss << ")";
+        if (depth>0) {
+            ss << " partition by range (\"" << partition_column(spec) << "\")";
+        } else {
+            ss << " with (autovacuum_enabled=false)";
+        }
+        
+        res.push_back("drop table if exists "+tab+" cascade");
+        res.push_back(ss.str());
+        
+        if (depth>0) {
+            std::string unl = options.unlogged ? "unlogged " : "";
+            int64 last = (1ll << (2*depth))-1;
+            for (int64 key=0; key <= last; key++) {
+                std::stringstream ps;
+                ps << "create " << unl << "table " << tab << partition_suffix(key, depth) << " partition of " << tab;
+                ps << " for values from (" << (key << (63-2*depth)) << ") to (";
+                if (key==last) {
+                    ps << "maxvalue";
+                } else {
+                    ps << ((key+1) << (63-2*depth));
+                }
+                ps << ") with (autovacuum_enabled=false)";
+                res.push_back(ps.str());
+            }
+            res.push_back("create "+unl+"table "+tab+"_qt_default partition of "+tab+" default with (autovacuum_enabled=false)");
+        }
+    } else if (options.table_mode==TableLoadMode::Truncate) {
+        res.push_back("truncate "+tab);
+        for (const auto& pt: partition_tables(tab, depth)) {
+            res.push_back("alter table "+pt+(options.unlogged ? " set unlogged" : " set logged"));
+            res.push_back("alter table "+pt+" set (autovacuum_enabled=false)");
+        }
+    }
+    return res;
+}
+
+void prepare_tables(const std::string& connection_string, const std::string& table_prfx, const std::vector<TableSpec>& specs, const PostgisWriterOptions& options) {
+    std::vector<std::string> queries;
+    for (const auto& spec: specs) {
+        for (const auto& q: prepare_table_queries(table_prfx, spec, options)) {
+            queries.push_back(q);
+        }
+    }
+    exec_queries(connection_string, queries);
+}
+
+void finish_tables(const std::string& connection_string, const std::string& table_prfx, const std::vector<TableSpec>& specs, const PostgisWriterOptions& options) {
+    if (!options.unlogged) { return; }
+    
+    std::vector<std::string> queries;
+    for (const auto& spec: specs) {
+        for (const auto& pt: partition_tables(table_prfx+spec.table_name, options.partition_depth)) {
+            queries.push_back("alter table "+pt+" set logged");
+        }
+    }
+    exec_queries(connection_string, queries);
+}
+
+std::string copy_sql(const std::string& tab, bool as_binary, bool with_header, bool freeze) {
+    std::string sql="COPY "+tab+" FROM STDIN";
+            
+    if (as_binary) {
+        sql += " (FORMAT binary";
+    } else {
+        sql += " (FORMAT csv, QUOTE e'\x01', DELIMITER e'\x02'";
+        if (with_header) {
+            sql += ", HEADER";
+        }
+    }
+    if (freeze) {
+        sql += ", FREEZE";
+    }
+    sql += ")";
+    return sql;
+}
+
+//true if all the tiles have been committed. Blocks merged by coalescing are
+//committed together, so a partly committed block means the blocks were
+//grouped differently in the previous run.
+bool tiles_committed(const std::unordered_set<int64>& committed, const std::vector<int64>& tiles) {
+    size_t c=0;
+    for (auto t: tiles) {
+        if (committed.count(t)>0) { c++; }
+    }
+    if (c==0) { return false; }
+    if (c==tiles.size()) { return true; }
+    Logger::Message() << "merged block partly committed: " << c << " of " << tiles.size() << " tiles";
+    throw std::domain_error("merged block partly committed in previous run");
+}
+
+bool checkpoint_due(const PostgisWriterOptions& options, size_t num_blocks, size_t num_bytes) {
+    if ((options.commit_blocks>0) && (num_blocks >= options.commit_blocks)) { return true; }
+    if ((options.commit_bytes>0) && (num_bytes >= options.commit_bytes)) { return true; }
+    return false;
+}
+
 class PostgisWriterImpl : public PostgisWriter {
     public:
         PostgisWriterImpl(
             const std::string& connection_string_,
             const std::string& table_prfx_,
-            bool with_header_, bool as_binary_)
-             : connection_string(connection_string_), table_prfx(table_prfx_), with_header(with_header_), as_binary(as_binary_), init(false), ii(0) {
-            
+            bool with_header_, bool as_binary_,
+            const PostgisWriterOptions& options_)
+             : connection_string(connection_string_), table_prfx(table_prfx_), with_header(with_header_), as_binary(as_binary_),
+               options(options_), init(false), ii(0), uncommitted_bytes(0) {
             
+            if (options.commits_enabled()) {
+                journal_table = import_journal_table(table_prfx);
+            }
             
         }
         
@@ -1206,10 +1975,14 @@ class PostgisWriterImpl : public PostgisWriter {
         
         
         virtual void finish() {
+            if (!options.owned_tables.empty()) {
+                //make sure the tables are created even if there were no rows
+                connect();
+            }
             if (init) {
-                auto res = PQexec(conn,"commit");
-                PQclear(res);
+                checkpoint(false);
                 PQfinish(conn);
+                init=false;
             }
         }
         
@@ -1217,27 +1990,34 @@ class PostgisWriterImpl : public PostgisWriter {
             
             try {
                 for (const auto& cc: bl->rows()) {
-                    copy_func(table_prfx+cc.first, cc.second.data_blob());        
+                    if (options.resume && is_committed(cc.first, bl->tiles())) {
+                        continue;
+                    }
+                    StageCounters send, wait;
+                    copy_func(partition_table(table_prfx+cc.first, bl->quadtree(), options.partition_depth), cc.second.data_blob(),
+                        options.stats ? &send : nullptr, options.stats ? &wait : nullptr);
+                    if (options.stats) {
+                        send.rows = cc.second.size() - ((with_header && (cc.second.size()>0)) ? 1 : 0);
+                        send.bytes = cc.second.data_blob().size();
+                        options.stats->add("copy", cc.first, send);
+                        options.stats->add("server", cc.first, wait);
+                    }
+                    if (!journal_table.empty()) {
+                        auto& uc = uncommitted[cc.first];
+                        uc.insert(uc.end(), bl->tiles().begin(), bl->tiles().end());
+                        uncommitted_bytes += cc.second.data_blob().size();
+                    }
                 }
                 
-                ii++;
-                /*if ((ii % 17731)==0) {
-                    auto res = PQexec(conn,"commit");
-                    int r = PQresultStatus(res);
-                    PQclear(res);
-                    if (r!=PGRES_COMMAND_OK){
-                        Logger::Message() << "postgiswriter: commit failed " << PQerrorMessage(conn);
-                        PQfinish(conn);
-                        throw std::domain_error("failed");
-                    }
-                    res = PQexec(conn,"begin");
-                    PQclear(res);
-                }*/
+                ii += bl->tiles().size();
+                if (checkpoint_due(options, ii, uncommitted_bytes)) {
+                    checkpoint(true);
+                }
             } catch (std::exception& ex) {
                 
                 write_csv_block("previous.data", prev_block);
                 write_csv_block("current.data", bl);
-                throw ex;
+                throw;
             }
                 
             prev_block=bl;
@@ -1246,36 +2026,67 @@ class PostgisWriterImpl : public PostgisWriter {
         
         
     private:
-        size_t copy_func(const std::string& tab, const std::string& data) {
-            if (!init) {
-                conn = PQconnectdb(connection_string.c_str());
-                if (!conn) {
-                    Logger::Message() << "connection to postgresql failed [" << connection_string << "]";
-                    throw std::domain_error("connection to postgressql failed");
-                }
-                auto res = PQexec(conn,"begin");
-                if (PQresultStatus(res)!=PGRES_COMMAND_OK) {
-                    Logger::Message() << "begin failed?? " <<  PQerrorMessage(conn);
-                    PQclear(res);
-                    PQfinish(conn);
-                    throw std::domain_error("begin failed");
-                    return 0;
-                }
-                PQclear(res);
-                init=true;
-            }
+        void connect() {
+            if (init) { return; }
             
+            conn = PQconnectdb(connection_string.c_str());
+            if (!conn) {
+                Logger::Message() << "connection to postgresql failed [" << connection_string << "]";
+                throw std::domain_error("connection to postgressql failed");
+            }
+            exec("begin");
+            init=true;
             
-            std::string sql="COPY "+tab+" FROM STDIN";
-            
-            if (as_binary) {
-                sql += " (FORMAT binary)";
-            } else {
-                sql += " csv QUOTE e'\x01' DELIMITER e'\x02'";
-                if (with_header) {
-                    sql += " HEADER";
+            for (const auto& spec: options.owned_tables) {
+                for (const auto& q: prepare_table_queries(table_prfx, spec, options)) {
+                    exec(q);
                 }
             }
+            options.owned_tables.clear();
+        }
+        
+        void exec(const std::string& sql) {
+            auto res = PQexec(conn,sql.c_str());
+            int r = PQresultStatus(res);
+            PQclear(res);
+            if (r!=PGRES_COMMAND_OK) {
+                Logger::Message() << "postgiswriter: " << sql << " failed " << PQerrorMessage(conn);
+                PQfinish(conn);
+                init=false;
+                throw std::domain_error(sql+" failed");
+            }
+        }
+        
+        bool is_committed(const std::string& tab, const std::vector<int64>& tiles) {
+            auto it = committed.find(tab);
+            if (it==committed.end()) {
+                connect();
+                it = committed.emplace(tab, read_import_journal(conn, journal_table, tab)).first;
+            }
+            return tiles_committed(it->second, tiles);
+        }
+        
+        void checkpoint(bool restart) {
+            if (!init) { return; }
+            for (const auto& uc: uncommitted) {
+                write_import_journal(conn, journal_table, uc.first, uc.second);
+            }
+            uncommitted.clear();
+            uncommitted_bytes=0;
+            ii=0;
+            
+            exec("commit");
+            if (restart) {
+                exec("begin");
+            }
+        }
+        
+        //the time to send the data is added to send, and the time waiting
+        //for the server to finish the copy to wait
+        size_t copy_func(const std::string& tab, const std::string& data, StageCounters* send, StageCounters* wait) {
+            connect();
+            
+            std::string sql=copy_sql(tab, as_binary, with_header, options.freeze);
             
             auto res = PQexec(conn,sql.c_str());
 
@@ -1289,26 +2100,32 @@ class PostgisWriterImpl : public PostgisWriter {
                 return 0;
             }
 
-            int r = PQputCopyData(conn,data.data(),data.size());
-            if (r!=1) {
-                Logger::Message() << "copy data failed {r=" << r<< "} [" << sql << "]" << PQerrorMessage(conn) << "\n" ;
-                PQputCopyEnd(conn,nullptr);
-                PQclear(res);
-                return 0;
-            }
+            {
+                StageTimer tm(send);
+                int r = PQputCopyData(conn,data.data(),data.size());
+                if (r!=1) {
+                    Logger::Message() << "copy data failed {r=" << r<< "} [" << sql << "]" << PQerrorMessage(conn) << "\n" ;
+                    PQputCopyEnd(conn,nullptr);
+                    PQclear(res);
+                    return 0;
+                }
 
-            
+                
 
-            r = PQputCopyEnd(conn,nullptr);
-            if (r!=PGRES_COMMAND_OK) {
-                Logger::Message() << "\n*****\ncopy failed [" << sql << "]" << PQerrorMessage(conn) << "\n" ;
-                    
-                return 0;
+                r = PQputCopyEnd(conn,nullptr);
+                if (r!=PGRES_COMMAND_OK) {
+                    Logger::Message() << "\n*****\ncopy failed [" << sql << "]" << PQerrorMessage(conn) << "\n" ;
+                        
+                    return 0;
+                }
             }
             
             PQclear(res);
             
-            res = PQgetResult(conn);
+            {
+                StageTimer tm(wait);
+                res = PQgetResult(conn);
+            }
             if (PQresultStatus(res) != PGRES_COMMAND_OK) {
                 Logger::Message() << "copy end failed: " << PQerrorMessage(conn);
                 throw std::domain_error("failed");
@@ -1321,18 +2138,810 @@ class PostgisWriterImpl : public PostgisWriter {
         std::string table_prfx;      
         bool with_header;  
         bool as_binary;
+        PostgisWriterOptions options;
         PGconn* conn;
         bool init;
         size_t ii;
         std::shared_ptr<CsvBlock> prev_block;
+        
+        std::string journal_table;
+        std::map<std::string,std::vector<int64>> uncommitted;
+        size_t uncommitted_bytes;
+        std::map<std::string,std::unordered_set<int64>> committed;
+};
+
+const std::string pgcopy_header("PGCOPY\n\xff\r\n\x00\x00\x00\x00\x00\x00\x00\x00\x00",19);
+const std::string pgcopy_trailer("\xff\xff",2);
+
+class CopyConnection {
+    public:
+        CopyConnection(const std::string& connection_string_, const std::string& table_, bool as_binary_, bool freeze_, size_t partition_depth_)
+            : connection_string(connection_string_), table(table_), as_binary(as_binary_), freeze(freeze_), partition_depth(partition_depth_),
+              target(table_), conn(nullptr), in_copy(false),
+              in_transaction(false), trailer_sent(false), timing_copy_end(false),
+              resume(false), journal_loaded(false), uncommitted_bytes(0),
+              send_stats(nullptr), wait_stats(nullptr) {}
+        
+        //count the time spent sending data and waiting for the server to
+        //finish each copy
+        void set_stats(StageCounters* send_stats_, StageCounters* wait_stats_) {
+            send_stats=send_stats_;
+            wait_stats=wait_stats_;
+        }
+        
+        //direct the following data to the partition holding tile. As blocks
+        //arrive in quadtree order this only rarely restarts the copy.
+        void select_partition(int64 tile) {
+            std::string tgt = partition_table(table, tile, partition_depth);
+            if (tgt==target) { return; }
+            end_copy();
+            target=tgt;
+        }
+        
+        //true if the data for tile would end the current copy: the
+        //nonblocking writer ends it with send_copy_end first
+        bool partition_changes(int64 tile) const {
+            return in_copy && (partition_table(table, tile, partition_depth)!=target);
+        }
+        
+        //queries (to create or truncate the table) to run at the start of
+        //the first transaction
+        void set_prepare_queries(const std::vector<std::string>& queries) {
+            prepare_queries = queries;
+        }
+        
+        void begin() {
+            connect();
+            if (!in_transaction) {
+                exec("begin");
+                in_transaction=true;
+                for (const auto& q: prepare_queries) {
+                    exec(q);
+                }
+                prepare_queries.clear();
+            }
+        }
+        
+        //record the block quadtrees of each commit as journal_key in
+        //journal_table. If resume is set, is_committed returns true for
+        //blocks recorded in a previous run.
+        void set_journal(const std::string& journal_table_, const std::string& journal_key_, bool resume_) {
+            journal_table=journal_table_;
+            journal_key=journal_key_;
+            resume=resume_;
+        }
+        
+        bool is_committed(const std::vector<int64>& tiles) {
+            if (!resume) { return false; }
+            if (!journal_loaded) {
+                connect();
+                committed = read_import_journal(conn, journal_table, journal_key);
+                journal_loaded=true;
+            }
+            return tiles_committed(committed, tiles);
+        }
+        
+        void add_block(const std::vector<int64>& tiles, size_t bytes) {
+            uncommitted_tiles.insert(uncommitted_tiles.end(), tiles.begin(), tiles.end());
+            uncommitted_bytes+=bytes;
+        }
+        
+        size_t uncommitted_blocks() const { return uncommitted_tiles.size(); }
+        size_t uncommitted_size() const { return uncommitted_bytes; }
+        
+        ~CopyConnection() {
+            if (conn) {
+                PQfinish(conn);
+            }
+        }
+        
+        void put(const char* data, size_t len) {
+            if (!in_copy) {
+                start_copy();
+            }
+            if (len==0) { return; }
+            
+            StageTimer tm(send_stats);
+            int r = PQputCopyData(conn, data, len);
+            if (r!=1) {
+                Logger::Message() << "copy data failed {r=" << r<< "} [" << table << "]" << PQerrorMessage(conn);
+                throw std::domain_error("copy data failed");
+            }
+        }
+        
+        //nonblocking variant of put: the data is queued by libpq and sent
+        //by calling flush when the socket is writable. Returns false if
+        //libpq's buffer is full: flush and try again once the socket is
+        //writable.
+        bool put_nonblocking(const char* data, size_t len) {
+            if (!in_copy) {
+                start_copy();
+            }
+            if (!PQisnonblocking(conn)) {
+                if (PQsetnonblocking(conn, 1)!=0) {
+                    Logger::Message() << "PQsetnonblocking failed [" << table << "]" << PQerrorMessage(conn);
+                    throw std::domain_error("PQsetnonblocking failed");
+                }
+            }
+            if (len==0) { return true; }
+            
+            //the caller counts the calls, once for each block
+            StageTimer tm(send_stats, false);
+            int r = PQputCopyData(conn, data, len);
+            if (r<0) {
+                Logger::Message() << "copy data failed {r=" << r<< "} [" << table << "]" << PQerrorMessage(conn);
+                throw std::domain_error("copy data failed");
+            }
+            return r==1;
+        }
+        
+        //returns true if there is still queued data to send
+        bool flush() {
+            if (!conn) { return false; }
+            StageTimer tm(send_stats, false);
+            int r = PQflush(conn);
+            if (r<0) {
+                Logger::Message() << "flush failed [" << table << "]" << PQerrorMessage(conn);
+                throw std::domain_error("flush failed");
+            }
+            return r==1;
+        }
+        
+        int socket() const {
+            if (!conn) { return -1; }
+            return PQsocket(conn);
+        }
+        
+        void consume_input() {
+            if (!conn) { return; }
+            if (PQconsumeInput(conn)!=1) {
+                Logger::Message() << "consume input failed [" << table << "]" << PQerrorMessage(conn);
+                throw std::domain_error("consume input failed");
+            }
+        }
+        
+        //nonblocking end_copy: returns false if libpq's buffer is full, to
+        //be called again once flushed. The result is read by poll_result.
+        bool send_copy_end() {
+            if (!in_copy) { return true; }
+            
+            if (as_binary && !trailer_sent) {
+                if (!put_nonblocking(pgcopy_trailer.data(), pgcopy_trailer.size())) {
+                    return false;
+                }
+                trailer_sent=true;
+            }
+            int r = PQputCopyEnd(conn, nullptr);
+            if (r<0) {
+                Logger::Message() << "copy end failed [" << table << "]" << PQerrorMessage(conn);
+                throw std::domain_error("copy end failed");
+            }
+            if (r==0) { return false; }
+            
+            in_copy=false;
+            trailer_sent=false;
+            timing_copy_end=true;
+            copy_end_start=std::chrono::steady_clock::now();
+            return true;
+        }
+        
+        //nonblocking commit, once the copy has been ended: the journal is
+        //written and the transaction committed by one query, whose result
+        //is read by poll_result
+        void send_commit() {
+            if (!in_transaction) { return; }
+            
+            std::string sql;
+            if (!journal_table.empty() && !uncommitted_tiles.empty()) {
+                sql = import_journal_sql(conn, journal_table, journal_key, uncommitted_tiles)+"; ";
+            }
+            sql += "commit";
+            if (PQsendQuery(conn, sql.c_str())!=1) {
+                Logger::Message() << "commit failed [" << table << "]: " << PQerrorMessage(conn);
+                throw std::domain_error("commit failed");
+            }
+            uncommitted_tiles.clear();
+            uncommitted_bytes=0;
+            in_transaction=false;
+        }
+        
+        //reads the results of send_copy_end or send_commit without
+        //blocking. Returns false while the server is still busy.
+        bool poll_result() {
+            if (!conn) { return true; }
+            consume_input();
+            while (!PQisBusy(conn)) {
+                auto res = PQgetResult(conn);
+                if (!res) {
+                    if (timing_copy_end && wait_stats) {
+                        wait_stats->calls++;
+                        wait_stats->seconds += std::chrono::duration<double>(std::chrono::steady_clock::now()-copy_end_start).count();
+                    }
+                    timing_copy_end=false;
+                    return true;
+                }
+                int r = PQresultStatus(res);
+                PQclear(res);
+                if (r != PGRES_COMMAND_OK) {
+                    Logger::Message() << "query failed [" << table << "]: " << PQerrorMessage(conn);
+                    throw std::domain_error("query failed");
+                }
+            }
+            return false;
+        }
+        
+        void end_copy() {
+            if (!in_copy) { return; }
+            
+            if (PQisnonblocking(conn)) {
+                while (flush()) {
+                    pollfd fd{socket(), POLLOUT, 0};
+                    poll(&fd, 1, -1);
+                }
+                PQsetnonblocking(conn, 0);
+            }
+            
+            if (as_binary) {
+                put(pgcopy_trailer.data(), pgcopy_trailer.size());
+            }
+            in_copy=false;
+            
+            StageTimer tm(wait_stats);
+            if (PQputCopyEnd(conn,nullptr)!=1) {
+                Logger::Message() << "copy end failed [" << table << "]" << PQerrorMessage(conn);
+                throw std::domain_error("copy end failed");
+            }
+            auto res = PQgetResult(conn);
+            int r = PQresultStatus(res);
+            PQclear(res);
+            if (r != PGRES_COMMAND_OK) {
+                Logger::Message() << "copy end failed [" << table << "]: " << PQerrorMessage(conn);
+                throw std::domain_error("copy end failed");
+            }
+            
+        }
+        
+        void commit() {
+            if (!in_transaction) { return; }
+            end_copy();
+            if (!journal_table.empty()) {
+                write_import_journal(conn, journal_table, journal_key, uncommitted_tiles);
+            }
+            uncommitted_tiles.clear();
+            uncommitted_bytes=0;
+            exec("commit");
+            in_transaction=false;
+        }
+        
+        void close() {
+            commit();
+            if (conn) {
+                PQfinish(conn);
+                conn=nullptr;
+            }
+        }
+        
+        //abandon the current copy and transaction, and close the connection
+        void abort(const std::string& msg) {
+            if (!conn) { return; }
+            if (in_copy) {
+                PQputCopyEnd(conn, msg.c_str());
+                in_copy=false;
+            }
+            PQfinish(conn);
+            conn=nullptr;
+        }
+        
+    private:
+        std::string connection_string;
+        std::string table;
+        bool as_binary;
+        bool freeze;
+        size_t partition_depth;
+        std::string target;
+        PGconn* conn;
+        bool in_copy;
+        bool in_transaction;
+        bool trailer_sent;
+        bool timing_copy_end;
+        std::chrono::steady_clock::time_point copy_end_start;
+        std::vector<std::string> prepare_queries;
+        
+        std::string journal_table;
+        std::string journal_key;
+        bool resume;
+        bool journal_loaded;
+        std::unordered_set<int64> committed;
+        std::vector<int64> uncommitted_tiles;
+        size_t uncommitted_bytes;
+        StageCounters* send_stats;
+        StageCounters* wait_stats;
+        
+        void connect() {
+            if (conn) { return; }
+            conn = PQconnectdb(connection_string.c_str());
+            if ((!conn) || (PQstatus(conn)!=CONNECTION_OK)) {
+                Logger::Message() << "connection to postgresql failed [" << connection_string << "]";
+                throw std::domain_error("connection to postgressql failed");
+            }
+        }
+        
+        void exec(const std::string& sql) {
+            auto res = PQexec(conn,sql.c_str());
+            int r = PQresultStatus(res);
+            PQclear(res);
+            if (r!=PGRES_COMMAND_OK) {
+                Logger::Message() << sql << " failed [" << table << "]: " << PQerrorMessage(conn);
+                throw std::domain_error(sql+" failed");
+            }
+        }
+        
+        void start_copy() {
+            begin();
+            
+            //the header row is stripped from each block, so always
+            //copy without the HEADER option
+            std::string sql=copy_sql(target, as_binary, false, freeze);
+            
+            auto res = PQexec(conn,sql.c_str());
+            int r = PQresultStatus(res);
+            PQclear(res);
+            if (r != PGRES_COPY_IN) {
+                Logger::Message() << "PQresultStatus != PGRES_COPY_IN [" << r << "] " <<  PQerrorMessage(conn);
+                Logger::Message() << sql;
+                throw std::domain_error("PQresultStatus != PGRES_COPY_IN");
+            }
+            in_copy=true;
+            
+            if (as_binary) {
+                put(pgcopy_header.data(), pgcopy_header.size());
+            }
+        }
+};
+
+std::unique_ptr<CopyConnection> make_copy_connection(const std::string& connection_string, const std::string& table_prfx, const std::string& tab, bool as_binary, const PostgisWriterOptions& options) {
+    auto conn = std::make_unique<CopyConnection>(connection_string, table_prfx+tab, as_binary, options.freeze, options.partition_depth);
+    if (options.commits_enabled()) {
+        conn->set_journal(import_journal_table(table_prfx), tab, options.resume);
+    }
+    for (const auto& spec: options.owned_tables) {
+        if (spec.table_name==tab) {
+            conn->set_prepare_queries(prepare_table_queries(table_prfx, spec, options));
+        }
+    }
+    return conn;
+}
+
+class PostgisWriterPersistent : public PostgisWriter {
+    public:
+        PostgisWriterPersistent(
+            const std::string& connection_string_,
+            const std::string& table_prfx_,
+            bool with_header_, bool as_binary_,
+            const PostgisWriterOptions& options_)
+             : connection_string(connection_string_), table_prfx(table_prfx_), with_header(with_header_), as_binary(as_binary_), options(options_) {}
+        
+        virtual ~PostgisWriterPersistent() {}
+        
+        virtual void finish() {
+            begin_owned_tables();
+            for (auto& cc: conns) {
+                cc.second->close();
+            }
+            conns.clear();
+            if (options.stats) {
+                flush_stage_counters(*options.stats, local_stats);
+            }
+        }
+        
+        virtual void call(std::shared_ptr<CsvBlock> bl) {
+            try {
+                begin_owned_tables();
+                for (const auto& cc: bl->rows()) {
+                    if (cc.second.size()==0) { continue; }
+                    auto& conn = get_conn(cc.first);
+                    if (conn.is_committed(bl->tiles())) {
+                        continue;
+                    }
+                    auto dd = cc.second.rows_data(with_header);
+                    conn.select_partition(bl->quadtree());
+                    conn.put(dd.first, dd.second);
+                    conn.add_block(bl->tiles(), dd.second);
+                    if (options.stats) {
+                        auto& st = local_stats["copy"][cc.first];
+                        st.rows += cc.second.size() - (with_header ? 1 : 0);
+                        st.bytes += dd.second;
+                    }
+                    if (checkpoint_due(options, conn.uncommitted_blocks(), conn.uncommitted_size())) {
+                        conn.commit();
+                    }
+                }
+                if (options.stats) {
+                    flush_stage_counters(*options.stats, local_stats);
+                }
+            } catch (std::exception& ex) {
+                write_csv_block("previous.data", prev_block);
+                write_csv_block("current.data", bl);
+                throw;
+            }
+            prev_block=bl;
+        }
+        
+    private:
+        std::string connection_string;
+        std::string table_prfx;
+        bool with_header;
+        bool as_binary;
+        PostgisWriterOptions options;
+        std::map<std::string, std::unique_ptr<CopyConnection>> conns;
+        std::shared_ptr<CsvBlock> prev_block;
+        stage_counters local_stats;
+        
+        CopyConnection& get_conn(const std::string& tab) {
+            auto it = conns.find(tab);
+            if (it==conns.end()) {
+                it = conns.emplace(tab, make_copy_connection(connection_string, table_prfx, tab, as_binary, options)).first;
+                if (options.stats) {
+                    it->second->set_stats(&local_stats["copy"][tab], &local_stats["server"][tab]);
+                }
+            }
+            return *it->second;
+        }
+        
+        void begin_owned_tables() {
+            for (const auto& spec: options.owned_tables) {
+                get_conn(spec.table_name).begin();
+            }
+            options.owned_tables.clear();
+        }
+};
+
+class PostgisWriterAsync : public PostgisWriter {
+    
+    struct Pending {
+        std::shared_ptr<CsvBlock> block;
+        int64 tile;
+        const char* data;
+        size_t len;
+        size_t sent;
+        size_t rows;
+    };
+    
+    //ending a copy and committing are sent, and their results polled
+    //for, without blocking the other tables' streams
+    enum class StreamState {
+        Sending,
+        EndingCopy,
+        AwaitingCopyEnd,
+        AwaitingCommit
+    };
+    
+    struct TableStream {
+        std::unique_ptr<CopyConnection> conn;
+        std::deque<Pending> pending;
+        size_t inflight=0;
+        bool flushing=false;
+        StreamState state=StreamState::Sending;
+        bool commit_due=false;
+    };
+    
+    public:
+        PostgisWriterAsync(
+            const std::string& connection_string_,
+            const std::string& table_prfx_,
+            bool with_header_, bool as_binary_,
+            const PostgisWriterOptions& options_)
+             : connection_string(connection_string_), table_prfx(table_prfx_), with_header(with_header_), as_binary(as_binary_),
+               options(options_), finishing(false), aborting(false) {
+            
+            if (pipe(wake_fds)!=0) {
+                throw std::domain_error("PostgisWriterAsync: pipe failed");
+            }
+            fcntl(wake_fds[0], F_SETFL, O_NONBLOCK);
+            fcntl(wake_fds[1], F_SETFL, O_NONBLOCK);
+            
+            io_thread = std::thread([this]() { run(); });
+        }
+        
+        virtual ~PostgisWriterAsync() {
+            if (io_thread.joinable()) {
+                //finish wasn't called: abort the copies rather than sending
+                //the rest of the data
+                {
+                    std::lock_guard<std::mutex> lk(mutex);
+                    aborting=true;
+                }
+                wake();
+                io_thread.join();
+                
+                if (error) {
+                    try {
+                        std::rethrow_exception(error);
+                    } catch (std::exception& ex) {
+                        Logger::Message() << "PostgisWriterAsync destroyed after error: " << ex.what();
+                    } catch (...) {
+                        Logger::Message() << "PostgisWriterAsync destroyed after error";
+                    }
+                }
+                for (auto& st: streams) {
+                    if (st.second.conn) {
+                        st.second.conn->abort("PostgisWriterAsync destroyed without finish");
+                    }
+                }
+            }
+            close(wake_fds[0]);
+            close(wake_fds[1]);
+        }
+        
+        virtual void finish() {
+            {
+                std::lock_guard<std::mutex> lk(mutex);
+                finishing=true;
+            }
+            wake();
+            io_thread.join();
+            
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            for (auto& st: streams) {
+                if (st.second.conn) {
+                    st.second.conn->close();
+                }
+            }
+        }
+        
+        virtual void call(std::shared_ptr<CsvBlock> bl) {
+            std::unique_lock<std::mutex> lk(mutex);
+            
+            for (const auto& cc: bl->rows()) {
+                if (cc.second.size()==0) { continue; }
+                
+                auto& st = streams[cc.first];
+                
+                //hand over the block as soon as the previous data for this
+                //table is within the in-flight budget. The io thread counts
+                //the copy and server stats.
+                cond.wait(lk, [this,&st]() { return error || (st.inflight < options.inflight_bytes); });
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+                auto dd = cc.second.rows_data(with_header);
+                size_t rows = cc.second.size() - (with_header ? 1 : 0);
+                st.pending.push_back(Pending{bl, bl->quadtree(), dd.first, dd.second, 0, rows});
+                st.inflight += dd.second;
+                
+                lk.unlock();
+                wake();
+                lk.lock();
+            }
+        }
+    
+    private:
+        std::string connection_string;
+        std::string table_prfx;
+        bool with_header;
+        bool as_binary;
+        PostgisWriterOptions options;
+        
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::map<std::string,TableStream> streams;
+        bool finishing;
+        bool aborting;
+        std::exception_ptr error;
+        
+        int wake_fds[2];
+        std::thread io_thread;
+        
+        //only used by the io thread
+        stage_counters local_stats;
+        
+        std::unique_ptr<CopyConnection> make_conn(const std::string& tab) {
+            auto conn = make_copy_connection(connection_string, table_prfx, tab, as_binary, options);
+            if (options.stats) {
+                conn->set_stats(&local_stats["copy"][tab], &local_stats["server"][tab]);
+            }
+            return conn;
+        }
+        
+        void wake() {
+            char c=0;
+            if (write(wake_fds[1], &c, 1)<0) {
+                //pipe is full: io thread is already due to wake up
+            }
+        }
+        
+        //push queued data for one stream until libpq can't send any more,
+        //or the server's result isn't ready, without blocking
+        void send_pending(const std::string& tab, TableStream& st) {
+            
+            const size_t chunk = 64*1024;
+            
+            while (!st.flushing) {
+                if (st.state==StreamState::EndingCopy) {
+                    if (!st.conn->send_copy_end()) {
+                        st.conn->flush();
+                        st.flushing = true;
+                        return;
+                    }
+                    st.state = StreamState::AwaitingCopyEnd;
+                    st.flushing = st.conn->flush();
+                    continue;
+                }
+                if (st.state==StreamState::AwaitingCopyEnd) {
+                    if (!st.conn->poll_result()) { return; }
+                    if (st.commit_due) {
+                        st.commit_due = false;
+                        st.conn->send_commit();
+                        st.state = StreamState::AwaitingCommit;
+                        st.flushing = st.conn->flush();
+                    } else {
+                        st.state = StreamState::Sending;
+                    }
+                    continue;
+                }
+                if (st.state==StreamState::AwaitingCommit) {
+                    if (!st.conn->poll_result()) { return; }
+                    st.state = StreamState::Sending;
+                    continue;
+                }
+                
+                Pending* pd=nullptr;
+                {
+                    std::lock_guard<std::mutex> lk(mutex);
+                    if (!st.pending.empty()) {
+                        pd = &st.pending.front();
+                    }
+                }
+                if (!pd) { return; }
+                
+                if (!st.conn) {
+                    st.conn = make_conn(tab);
+                }
+                
+                bool skip = (pd->sent==0) && st.conn->is_committed(pd->block->tiles());
+                if (!skip) {
+                    if (pd->sent==0) {
+                        if (st.conn->partition_changes(pd->tile)) {
+                            st.state = StreamState::EndingCopy;
+                            continue;
+                        }
+                        st.conn->select_partition(pd->tile);
+                    }
+                    size_t n = std::min(chunk, pd->len - pd->sent);
+                    if (!st.conn->put_nonblocking(pd->data + pd->sent, n)) {
+                        //libpq's buffer is full: retry once the poll loop
+                        //sees the socket writable
+                        st.conn->flush();
+                        st.flushing = true;
+                        return;
+                    }
+                    pd->sent += n;
+                }
+                if (skip || (pd->sent == pd->len)) {
+                    auto block = pd->block;
+                    size_t len = pd->len;
+                    size_t rows = pd->rows;
+                    {
+                        std::lock_guard<std::mutex> lk(mutex);
+                        st.inflight -= len;
+                        st.pending.pop_front();
+                        cond.notify_all();
+                    }
+                    if (!skip) {
+                        if (options.stats) {
+                            auto& sc = local_stats["copy"][tab];
+                            sc.calls++;
+                            sc.rows += rows;
+                            sc.bytes += len;
+                        }
+                        st.conn->add_block(block->tiles(), len);
+                        if (checkpoint_due(options, st.conn->uncommitted_blocks(), st.conn->uncommitted_size())) {
+                            st.state = StreamState::EndingCopy;
+                            st.commit_due = true;
+                        }
+                    }
+                }
+                st.flushing = st.conn->flush();
+            }
+        }
+        
+        void run() {
+            try {
+                for (const auto& spec: options.owned_tables) {
+                    TableStream* st;
+                    {
+                        std::lock_guard<std::mutex> lk(mutex);
+                        st = &streams[spec.table_name];
+                    }
+                    st->conn = make_conn(spec.table_name);
+                    st->conn->begin();
+                }
+                
+                while (true) {
+                    std::vector<std::pair<std::string,TableStream*>> active;
+                    bool done=false;
+                    {
+                        std::lock_guard<std::mutex> lk(mutex);
+                        if (aborting) { return; }
+                        done=finishing;
+                        for (auto& st: streams) {
+                            active.push_back(std::make_pair(st.first, &st.second));
+                        }
+                    }
+                    
+                    for (auto& st: active) {
+                        send_pending(st.first, *st.second);
+                    }
+                    if (options.stats) {
+                        flush_stage_counters(*options.stats, local_stats);
+                    }
+                    
+                    bool idle=true;
+                    std::vector<pollfd> fds;
+                    std::vector<TableStream*> fd_streams;
+                    fds.push_back(pollfd{wake_fds[0], POLLIN, 0});
+                    fd_streams.push_back(nullptr);
+                    {
+                        std::lock_guard<std::mutex> lk(mutex);
+                        for (auto& st: active) {
+                            if (st.second->flushing || !st.second->pending.empty() || (st.second->state!=StreamState::Sending)) {
+                                idle=false;
+                            }
+                            if (st.second->conn && (st.second->conn->socket()>=0)) {
+                                short ev = POLLIN;
+                                if (st.second->flushing) { ev |= POLLOUT; }
+                                fds.push_back(pollfd{st.second->conn->socket(), ev, 0});
+                                fd_streams.push_back(st.second);
+                            }
+                        }
+                    }
+                    
+                    if (done && idle) {
+                        return;
+                    }
+                    
+                    if (poll(&fds[0], fds.size(), -1) < 0) {
+                        if (errno==EINTR) { continue; }
+                        throw std::domain_error("PostgisWriterAsync: poll failed");
+                    }
+                    
+                    if (fds[0].revents & POLLIN) {
+                        char buf[256];
+                        while (read(wake_fds[0], buf, sizeof(buf))>0) {}
+                    }
+                    for (size_t i=1; i < fds.size(); i++) {
+                        auto st = fd_streams[i];
+                        if (fds[i].revents & POLLIN) {
+                            st->conn->consume_input();
+                        }
+                        if (fds[i].revents & (POLLOUT | POLLERR | POLLHUP)) {
+                            st->flushing = st->conn->flush();
+                        }
+                    }
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lk(mutex);
+                error = std::current_exception();
+                cond.notify_all();
+            }
+        }
 };
 
 std::shared_ptr<PostgisWriter> make_postgiswriter(
     const std::string& connection_string,
     const std::string& table_prfx,
-    bool with_header, bool as_binary) {
+    bool with_header, bool as_binary,
+    const PostgisWriterOptions& options) {
     
-    return std::make_shared<PostgisWriterImpl>(connection_string, table_prfx, with_header, as_binary);
+    if (options.async_copy) {
+        return std::make_shared<PostgisWriterAsync>(connection_string, table_prfx, with_header, as_binary, options);
+    }
+    if (options.persistent_copy) {
+        return std::make_shared<PostgisWriterPersistent>(connection_string, table_prfx, with_header, as_binary, options);
+    }
+    return std::make_shared<PostgisWriterImpl>(connection_string, table_prfx, with_header, as_binary, options);
 }
 
 class CsvBlockCount {
@@ -1364,14 +2973,15 @@ class CsvBlockCount {
 std::function<void(std::shared_ptr<CsvBlock>)> make_postgiswriter_callback(
             const std::string& connection_string,
             const std::string& table_prfx,
-            bool with_header, bool as_binary) {
+            bool with_header, bool as_binary,
+            const PostgisWriterOptions& options) {
     
     if (connection_string=="null") {
         auto cbc=std::make_shared<CsvBlockCount>();
         return [cbc](std::shared_ptr<CsvBlock> bl) { cbc->call(bl); };
     }
     
-    auto pw = make_postgiswriter(connection_string,table_prfx, with_header, as_binary);
+    auto pw = make_postgiswriter(connection_string,table_prfx, with_header, as_binary, options);
     return [pw](std::shared_ptr<CsvBlock> bl) {
         if (!bl) {
             Logger::Message() << "PostgisWriter done";
@@ -24,7 +24,10 @@
 #define GEOMETRY_POSTGISWRITER_HPP
 
 #include "oqt/elements/block.hpp"
+#include "postgisstats.hpp"
+#include <bitset>
 #include <map>
+#include <optional>
 
 
 namespace oqt {
@@ -32,20 +35,71 @@ namespace geometry {
 
 
 
+//CsvRows buffers are taken from, and returned to, a shared pool holding
+//at most limit bytes
+void set_csvrows_pool_limit(size_t limit);
+size_t csvrows_pool_size();
+
 class CsvRows {
     
     public:
         CsvRows(bool is_binary_);
+        ~CsvRows();
+        
+        CsvRows(const CsvRows&) = default;
+        CsvRows(CsvRows&&) = default;
+        CsvRows& operator=(const CsvRows&) = default;
+        CsvRows& operator=(CsvRows&&) = default;
         
         bool is_binary() { return _is_binary; }
         
         void finish();
-        void add(const std::string row);
+        void add(const std::string& row);
+        
+        //write a binary row directly into the buffer: begin_row, then
+        //one of the add_ calls for each field, then end_row
+        void begin_row(size_t num_fields);
+        void add_null();
+        void add_int32(int64 v);
+        void add_int64(int64 v);
+        void add_double(double v);
+        void add_field(const char* d, size_t len);
+        void add_field(const std::string& v) { add_field(v.data(), v.size()); }
+        
+        //a field of unknown length: write the value with append_data,
+        //then end_field fills in the length
+        size_t begin_field();
+        void append_data(const char* d, size_t len);
+        void end_field(size_t pos);
+        
+        void end_row();
+        
+        //write a text row directly into the buffer: begin_text_row, then
+        //one of the text_ calls for each non-empty field, with text_delim
+        //between fields, then end_text_row
+        void begin_text_row();
+        void text_int(int64 v);
+        void text_double(double v);
+        void text_quoted(const std::string& v);
+        void text_hex(const std::string& v);
+        void text_raw(const std::string& v);
+        void text_delim();
+        void end_text_row();
+        
         std::string at(int i) const;
         int size() const;
         
         const std::string& data_blob() const { return data; }
         
+        //the rows without the binary header and trailer, also skipping
+        //the first row if it is a csv header
+        std::pair<const char*,size_t> rows_data(bool skip_header) const;
+        
+        //append the rows of another finished CsvRows, skipping its csv
+        //header row if this already has one. The binary trailer is moved
+        //to the end, so the result is still finished.
+        void append(const CsvRows& other, bool skip_header);
+        
     private:
         bool _is_binary;
         
@@ -53,31 +107,98 @@ class CsvRows {
         std::vector<size_t> poses;
 };
 
+//the tables of a packer: the table id is the index into this list
+typedef std::vector<std::string> table_names;
+
 class CsvBlock {
     
     
     public:
-        CsvBlock(bool is_binary_) : is_binary(is_binary_) {}
+        CsvBlock(bool is_binary_, int64 quadtree_=-1, int64 index_=-1, std::shared_ptr<const table_names> names_=nullptr)
+            : is_binary(is_binary_), quadtree_(quadtree_), index_(index_), tiles_{quadtree_}, names(names_) {
+            if (!names) {
+                names = std::make_shared<table_names>();
+            }
+        }
         virtual ~CsvBlock() {}
         
-        CsvRows& get(const std::string& tab) {
-            if (rows_.count(tab)==0) {
-                rows_.insert(std::make_pair(tab,CsvRows(is_binary)));
+        CsvRows& get(size_t table_id) {
+            if (table_id >= rows_.size()) {
+                rows_.resize(names->size());
+            }
+            auto& rr = rows_.at(table_id);
+            if (!rr) {
+                rr.emplace(is_binary);
             }
-            return rows_.at(tab);
+            return *rr;
         }
         
+        //adds tab to the table names if not already present
+        CsvRows& get(const std::string& tab) { return get(table_id(tab)); }
+        
         void finish() {
             for (auto& r: rows_) {
-                r.second.finish();
+                if (r) { r->finish(); }
             }
         }
         
-        const std::map<std::string,CsvRows>& rows() const { return rows_; } 
+        //the tables with rows, as (name, rows) pairs in table id order
+        class rows_view {
+            public:
+                typedef std::pair<const std::string&, const CsvRows&> value_type;
+                
+                class iterator {
+                    public:
+                        iterator(const CsvBlock* block_, size_t i_) : block(block_), i(i_) { skip(); }
+                        value_type operator*() const { return value_type(block->names->at(i), *block->rows_[i]); }
+                        iterator& operator++() { i++; skip(); return *this; }
+                        bool operator!=(const iterator& other) const { return i!=other.i; }
+                    private:
+                        void skip() { while ((i < block->rows_.size()) && !block->rows_[i]) { i++; } }
+                        const CsvBlock* block;
+                        size_t i;
+                };
+                
+                rows_view(const CsvBlock* block_) : block(block_) {}
+                iterator begin() const { return iterator(block, 0); }
+                iterator end() const { return iterator(block, block->rows_.size()); }
+            private:
+                const CsvBlock* block;
+        };
+        
+        rows_view rows() const { return rows_view(this); }
+        
+        std::shared_ptr<const table_names> tables() const { return names; }
+        
+        //move the rows for tab into a new block
+        std::shared_ptr<CsvBlock> split(const std::string& tab);
+        
+        //append the rows for tab from the block with quadtree tile
+        void merge(const std::string& tab, const CsvRows& other, bool skip_header, int64 tile) {
+            get(tab).append(other, skip_header);
+            if (tiles_.back()!=tile) {
+                tiles_.push_back(tile);
+            }
+        }
+        
+        int64 quadtree() const { return quadtree_; }
+        
+        //index of the source PrimitiveBlock
+        int64 index() const { return index_; }
+        
+        //quadtrees of the source blocks: more than one if blocks have
+        //been merged
+        const std::vector<int64>& tiles() const { return tiles_; }
     
     private:
+        size_t table_id(const std::string& tab);
+        
         bool is_binary;
-        std::map<std::string, CsvRows> rows_;
+        int64 quadtree_;
+        int64 index_;
+        std::vector<int64> tiles_;
+        std::shared_ptr<const table_names> names;
+        std::vector<std::optional<CsvRows>> rows_;
 };
 
 enum class ColumnType {
@@ -143,8 +264,124 @@ typedef std::function<std::vector<std::string>(ElementPtr)> table_alloc_func;
 
 std::vector<std::string> default_table_alloc(ElementPtr geom);
 
+//a set of table ids: a packer has at most max_tables tables
+const size_t max_tables = 64;
+typedef std::bitset<max_tables> table_set;
+typedef std::function<table_set(ElementPtr)> table_id_alloc_func;
+
+//an allocator which can also route elements straight to table ids,
+//avoiding building the list of table names for each element
+class TableIdAlloc {
+    public:
+        virtual ~TableIdAlloc() {}
+        
+        virtual std::vector<std::string> call(ElementPtr ele) const = 0;
+        
+        //the id of each table is its index in tables: any other table
+        //is dropped
+        virtual table_id_alloc_func resolve(const table_names& tables) const = 0;
+};
+
+//a table_alloc_func calling alloc, which the packers route by table id
+table_alloc_func make_table_alloc_func(std::shared_ptr<const TableIdAlloc> alloc);
+
+//the TableIdAlloc from make_table_alloc_func, or nullptr
+std::shared_ptr<const TableIdAlloc> get_table_id_alloc(const table_alloc_func& func);
+
+//the tables for each element of a block, in the same order as
+//block->Objects(): used instead of a table_alloc_func when set
+typedef std::function<std::vector<std::vector<std::string>>(PrimitiveBlockPtr)> block_table_alloc_func;
+
+
+class WorkStealingPool;
+
+//if geometry_pool is set, geometries with at least geometry_pool_min_points
+//points which need geos are prepared on the pool
+std::shared_ptr<PackCsvBlocks> make_pack_csvblocks(const PackCsvBlocks::tagspec& tags, bool with_header, bool binary_format, table_alloc_func table_alloc, bool split_multipolygons, bool validate_polygons, bool round_geometry,
+    std::shared_ptr<WorkStealingPool> geometry_pool=nullptr, size_t geometry_pool_min_points=0, block_table_alloc_func block_alloc=nullptr,
+    std::shared_ptr<PostgisStats> stats=nullptr);
+
+struct PackCsvBlocksBenchmark {
+    PackCsvBlocksBenchmark() : num_blocks(0), num_rows(0), text_seconds(0), text_bytes(0), binary_seconds(0), binary_bytes(0) {}
+    size_t num_blocks;
+    size_t num_rows;
+    double text_seconds;
+    size_t text_bytes;
+    double binary_seconds;
+    size_t binary_bytes;
+};
+
+//time packing the blocks repeats times with the text and with the binary
+//encoder (without geometry validation or rounding)
+PackCsvBlocksBenchmark benchmark_pack_csvblocks(const PackCsvBlocks::tagspec& tags, const std::vector<PrimitiveBlockPtr>& blocks, table_alloc_func table_alloc, bool split_multipolygons, size_t repeats);
+
+enum class TableLoadMode {
+    Existing,
+    Create,
+    Truncate
+};
+
+struct PostgisWriterOptions {
+    PostgisWriterOptions() : persistent_copy(false), async_copy(false), inflight_bytes(64*1024*1024),
+        commit_blocks(0), commit_bytes(0), resume(false), table_mode(TableLoadMode::Existing), freeze(false), unlogged(false), partition_depth(0) {}
+    
+    //keep one connection per table, with a single COPY statement left
+    //open across blocks until finish
+    bool persistent_copy;
+    
+    //as persistent_copy, but with nonblocking connections flushed by a
+    //separate io thread. call only blocks once more than inflight_bytes
+    //are waiting to be sent for a table.
+    bool async_copy;
+    size_t inflight_bytes;
+    
+    //commit every commit_blocks blocks or commit_bytes bytes (0 for only
+    //at finish). The block quadtrees included in each commit are recorded
+    //in the table [table_prfx]import_journal.
+    size_t commit_blocks;
+    size_t commit_bytes;
+    
+    //skip the rows of any block already recorded in the import journal
+    bool resume;
+    
+    bool commits_enabled() const { return (commit_blocks>0) || (commit_bytes>0); }
+    
+    //create (or truncate) the tables before loading. Unless freeze is set
+    //this is done up front by prepare_tables.
+    TableLoadMode table_mode;
+    
+    //the writers create or truncate the tables in the same transaction as
+    //the COPY, using COPY ... FREEZE. Requires a single connection per
+    //table and no intermediate commits.
+    bool freeze;
+    
+    //create the tables as UNLOGGED, switched to logged by finish_tables
+    bool unlogged;
+    
+    //range partition the tables on the BlockQuadtree column, with one
+    //partition for each quadtree at this depth (plus a default partition).
+    //The writers copy directly into the partitions.
+    size_t partition_depth;
+    
+    //tables created or truncated by this writer (set when freeze is used)
+    std::vector<TableSpec> owned_tables;
+    
+    //if set, the copy and server wait times, and the rows and bytes
+    //written for each table, are added to stats
+    std::shared_ptr<PostgisStats> stats;
+};
+
+std::vector<std::string> prepare_table_queries(const std::string& table_prfx, const TableSpec& spec, const PostgisWriterOptions& options);
+void prepare_tables(const std::string& connection_string, const std::string& table_prfx, const std::vector<TableSpec>& specs, const PostgisWriterOptions& options);
+void finish_tables(const std::string& connection_string, const std::string& table_prfx, const std::vector<TableSpec>& specs, const PostgisWriterOptions& options);
+
+//name of the partition of tab holding blocks with quadtree qt, or tab
+//itself if depth is zero
+std::string partition_table(const std::string& tab, int64 qt, size_t depth);
 
-std::shared_ptr<PackCsvBlocks> make_pack_csvblocks(const PackCsvBlocks::tagspec& tags, bool with_header, bool binary_format, table_alloc_func table_alloc, bool split_multipolygons, bool validate_polygons, bool round_geometry);
+//create the import journal table, dropping any existing entries unless
+//resume is set
+void prepare_import_journal(const std::string& connection_string, const std::string& table_prfx, bool resume);
 
 class PostgisWriter {
     public:
@@ -157,12 +394,14 @@ class PostgisWriter {
 std::shared_ptr<PostgisWriter> make_postgiswriter(
     const std::string& connection_string,
     const std::string& table_prfx,
-    bool with_header, bool binary_format);
+    bool with_header, bool binary_format,
+    const PostgisWriterOptions& options=PostgisWriterOptions());
 
 std::function<void(std::shared_ptr<CsvBlock>)> make_postgiswriter_callback(
     const std::string& connection_string,
     const std::string& table_prfx,
-    bool with_header, bool binary_format);
+    bool with_header, bool binary_format,
+    const PostgisWriterOptions& options=PostgisWriterOptions());
 
 }}  
 
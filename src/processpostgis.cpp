@@ -36,14 +36,24 @@
 #include "oqt/utils/multithreadedcallback.hpp"
 #include "oqt/utils/splitcallback.hpp"
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+
+#include "workpool.hpp"
+
 namespace oqt {
 namespace geometry {
 
 
 
 
-block_callback make_pack_csvblocks_callback(block_callback cb, std::function<void(std::shared_ptr<CsvBlock>)> wr, PackCsvBlocks::tagspec tags,bool with_header,bool as_binary, table_alloc_func alloc_func, bool split_multipolygons, bool validate_geometry, bool round_geometry) {
-    auto pc = make_pack_csvblocks(tags,with_header,as_binary, alloc_func, split_multipolygons,validate_geometry,round_geometry);
+block_callback make_pack_csvblocks_callback(block_callback cb, std::function<void(std::shared_ptr<CsvBlock>)> wr, PackCsvBlocks::tagspec tags,bool with_header,bool as_binary, table_alloc_func alloc_func, block_table_alloc_func block_alloc_func, bool split_multipolygons, bool validate_geometry, bool round_geometry,
+    std::shared_ptr<WorkStealingPool> geometry_pool=nullptr, size_t geometry_pool_min_points=0, std::shared_ptr<PostgisStats> stats=nullptr) {
+    auto pc = make_pack_csvblocks(tags,with_header,as_binary, alloc_func, split_multipolygons,validate_geometry,round_geometry, geometry_pool, geometry_pool_min_points, block_alloc_func, stats);
     return [cb, wr, pc](PrimitiveBlockPtr bl) {
         if (!bl) {
             //std::cout << "pack_csvblocks done" << std::endl;
@@ -64,31 +74,536 @@ block_callback make_pack_csvblocks_callback(block_callback cb, std::function<voi
                 
                             
 
+class CsvBlockTableRouter {
+    public:
+        CsvBlockTableRouter(
+            const std::string& connection_string, const std::string& table_prfx,
+            bool with_header, bool as_binary,
+            const PostgisWriterOptions& writer_options,
+            const PackCsvBlocks::tagspec& coltags,
+            const std::map<std::string,size_t>& table_connections) {
+            
+            for (const auto& ts: coltags) {
+                size_t nc = 1;
+                auto it = table_connections.find(ts.table_name);
+                if ((it!=table_connections.end()) && (it->second>1)) {
+                    nc = it->second;
+                }
+                
+                //with freeze each table is created by its own writer
+                PostgisWriterOptions table_options = writer_options;
+                if (writer_options.freeze) {
+                    table_options.owned_tables = {ts};
+                }
+                
+                auto& pool = pools[ts.table_name];
+                for (size_t i=0; i < nc; i++) {
+                    pool.writers.push_back(threaded_callback<CsvBlock>::make(
+                        make_postgiswriter_callback(connection_string, table_prfx, with_header, as_binary, table_options)));
+                }
+                Logger::Message() << "table " << ts.table_name << ": " << nc << " writers";
+            }
+        }
+        
+        void call(std::shared_ptr<CsvBlock> bl) {
+            if (!bl) {
+                for (auto& pl: pools) {
+                    for (auto& wr: pl.second.writers) {
+                        wr(nullptr);
+                    }
+                }
+                return;
+            }
+            
+            std::vector<std::string> tabs;
+            for (const auto& cc: bl->rows()) {
+                tabs.push_back(cc.first);
+            }
+            
+            for (const auto& tab: tabs) {
+                auto it = pools.find(tab);
+                if (it==pools.end()) {
+                    Logger::Message() << "CsvBlockTableRouter: unknown table " << tab;
+                    continue;
+                }
+                auto& pool = it->second;
+                pool.writers[pool.next](bl->split(tab));
+                pool.next = (pool.next+1) % pool.writers.size();
+            }
+        }
+        
+    private:
+        struct WriterPool {
+            std::vector<std::function<void(std::shared_ptr<CsvBlock>)>> writers;
+            size_t next=0;
+        };
+        std::map<std::string,WriterPool> pools;
+};
+
+class CsvBlockReorder {
+    public:
+        CsvBlockReorder(std::function<void(std::shared_ptr<CsvBlock>)> writer_, size_t window_)
+            : writer(writer_), window(window_), next_index(0), late(0) {}
+        
+        void call(std::shared_ptr<CsvBlock> bl) {
+            if (!bl) {
+                while (!pending.empty()) {
+                    pop_front();
+                }
+                if (late>0) {
+                    Logger::Message() << "CsvBlockReorder: " << late << " blocks written out of order";
+                }
+                writer(nullptr);
+                return;
+            }
+            
+            if (bl->index() < next_index) {
+                //already passed over: can't be written in order
+                late++;
+                writer(bl);
+                return;
+            }
+            
+            if (!pending.emplace(bl->index(), bl).second) {
+                //a second block with the same index: don't drop it
+                late++;
+                writer(bl);
+                return;
+            }
+            
+            //blocks may be missing from the sequence: once the window
+            //is full skip ahead to the lowest block held
+            while (!pending.empty() && ((pending.begin()->first==next_index) || (pending.size() > window))) {
+                pop_front();
+            }
+        }
+        
+    private:
+        std::function<void(std::shared_ptr<CsvBlock>)> writer;
+        size_t window;
+        int64 next_index;
+        size_t late;
+        std::map<int64, std::shared_ptr<CsvBlock>> pending;
+        
+        void pop_front() {
+            auto it = pending.begin();
+            next_index = it->first+1;
+            auto bl = it->second;
+            pending.erase(it);
+            writer(bl);
+        }
+};
+
+class CsvBlockCoalesce {
+    public:
+        CsvBlockCoalesce(std::function<void(std::shared_ptr<CsvBlock>)> writer_, bool with_header_, bool as_binary_,
+            const CoalesceParameters& params_, size_t partition_depth_)
+            : writer(writer_), with_header(with_header_), as_binary(as_binary_), params(params_), partition_depth(partition_depth_),
+              num_in(0), num_out(0) {}
+        
+        void call(std::shared_ptr<CsvBlock> bl) {
+            if (!bl) {
+                for (auto& pp: pending) {
+                    flush(pp.second);
+                }
+                if (num_out>0) {
+                    Logger::Message() << "CsvBlockCoalesce: merged " << num_in << " table blocks into " << num_out;
+                }
+                writer(nullptr);
+                return;
+            }
+            
+            auto now = std::chrono::steady_clock::now();
+            for (const auto& cc: bl->rows()) {
+                if (cc.second.size()==0) { continue; }
+                num_in++;
+                
+                auto& pp = pending[cc.first];
+                //rows for different partitions can't share a COPY
+                if (pp.block && (partition_table("", pp.block->quadtree(), partition_depth) != partition_table("", bl->quadtree(), partition_depth))) {
+                    flush(pp);
+                }
+                if (!pp.block) {
+                    pp.block = std::make_shared<CsvBlock>(as_binary, bl->quadtree(), bl->index(), bl->tables());
+                    pp.start = now;
+                }
+                pp.block->merge(cc.first, cc.second, with_header, bl->quadtree());
+                pp.rows += cc.second.size();
+                pp.bytes += cc.second.data_blob().size();
+                
+                if (((params.max_bytes>0) && (pp.bytes >= params.max_bytes)) || ((params.max_rows>0) && (pp.rows >= params.max_rows))) {
+                    flush(pp);
+                }
+            }
+            
+            if (params.max_seconds>0) {
+                for (auto& pp: pending) {
+                    if (pp.second.block && (std::chrono::duration<double>(now - pp.second.start).count() >= params.max_seconds)) {
+                        flush(pp.second);
+                    }
+                }
+            }
+        }
+        
+    private:
+        struct Pending {
+            std::shared_ptr<CsvBlock> block;
+            size_t rows=0;
+            size_t bytes=0;
+            std::chrono::steady_clock::time_point start;
+        };
+        
+        std::function<void(std::shared_ptr<CsvBlock>)> writer;
+        bool with_header;
+        bool as_binary;
+        CoalesceParameters params;
+        size_t partition_depth;
+        std::map<std::string,Pending> pending;
+        size_t num_in;
+        size_t num_out;
+        
+        void flush(Pending& pp) {
+            if (!pp.block) { return; }
+            auto bl = pp.block;
+            pp.block.reset();
+            pp.rows=0;
+            pp.bytes=0;
+            num_out++;
+            writer(bl);
+        }
+};
+
+std::function<void(std::shared_ptr<CsvBlock>)> make_csvblock_coalesce(
+    std::function<void(std::shared_ptr<CsvBlock>)> writer,
+    bool with_header, bool as_binary,
+    const CoalesceParameters& params, size_t partition_depth) {
+    
+    if (!params.enabled()) {
+        return writer;
+    }
+    auto coalesce = std::make_shared<CsvBlockCoalesce>(writer, with_header, as_binary, params, partition_depth);
+    return [coalesce](std::shared_ptr<CsvBlock> bl) { coalesce->call(bl); };
+}
+
+//hands the packed blocks from num_producers threads to writer, running on
+//its own thread. Producers block while the queued blocks hold more than
+//max_bytes of data.
+class CsvBlockQueue {
+    public:
+        CsvBlockQueue(std::function<void(std::shared_ptr<CsvBlock>)> writer_, size_t num_producers_, size_t max_bytes_, std::shared_ptr<PostgisStats> stats_)
+            : writer(writer_), num_producers(num_producers_), max_bytes(max_bytes_), stats(stats_),
+              producers_done(0), bytes(0), high_water(0), num_blocks(0), num_blocked(0), blocked_time(0), depth_sum(0) {
+            
+            consumer = std::thread([this]() { run(); });
+        }
+        
+        ~CsvBlockQueue() {
+            if (consumer.joinable()) {
+                {
+                    std::lock_guard<std::mutex> lk(mutex);
+                    producers_done = num_producers;
+                }
+                cond_pop.notify_all();
+                consumer.join();
+            }
+        }
+        
+        void push(std::shared_ptr<CsvBlock> bl) {
+            std::unique_lock<std::mutex> lk(mutex);
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            
+            if (!bl) {
+                producers_done++;
+                if (producers_done < num_producers) {
+                    return;
+                }
+                lk.unlock();
+                cond_pop.notify_all();
+                consumer.join();
+                
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+                return;
+            }
+            
+            size_t sz = block_size(bl);
+            
+            //always accept a block if the queue is empty, even if it is
+            //larger than max_bytes
+            if ((bytes>0) && ((bytes+sz) > max_bytes)) {
+                auto st = std::chrono::steady_clock::now();
+                cond_push.wait(lk, [this,sz]() { return error || (bytes==0) || ((bytes+sz) <= max_bytes); });
+                num_blocked++;
+                blocked_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-st).count();
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+            }
+            
+            queue.push_back(std::make_pair(bl, sz));
+            bytes += sz;
+            high_water = std::max(high_water, bytes);
+            num_blocks++;
+            depth_sum += bytes;
+            
+            lk.unlock();
+            cond_pop.notify_one();
+        }
+        
+    private:
+        std::function<void(std::shared_ptr<CsvBlock>)> writer;
+        size_t num_producers;
+        size_t max_bytes;
+        std::shared_ptr<PostgisStats> stats;
+        
+        std::mutex mutex;
+        std::condition_variable cond_push;
+        std::condition_variable cond_pop;
+        std::deque<std::pair<std::shared_ptr<CsvBlock>,size_t>> queue;
+        size_t producers_done;
+        std::exception_ptr error;
+        std::thread consumer;
+        
+        size_t bytes;
+        size_t high_water;
+        size_t num_blocks;
+        size_t num_blocked;
+        double blocked_time;
+        double depth_sum;
+        
+        static size_t block_size(std::shared_ptr<CsvBlock> bl) {
+            size_t sz=0;
+            for (const auto& cc: bl->rows()) {
+                sz += cc.second.data_blob().size();
+            }
+            return sz;
+        }
+        
+        void run() {
+            bool finishing=false;
+            try {
+                while (true) {
+                    std::shared_ptr<CsvBlock> bl;
+                    {
+                        std::unique_lock<std::mutex> lk(mutex);
+                        cond_pop.wait(lk, [this]() { return (!queue.empty()) || (producers_done==num_producers); });
+                        if (queue.empty()) {
+                            break;
+                        }
+                        bl = queue.front().first;
+                        bytes -= queue.front().second;
+                        queue.pop_front();
+                    }
+                    cond_push.notify_all();
+                    writer(bl);
+                }
+                finishing=true;
+                writer(nullptr);
+            } catch (...) {
+                {
+                    std::lock_guard<std::mutex> lk(mutex);
+                    error = std::current_exception();
+                    queue.clear();
+                    bytes=0;
+                    cond_push.notify_all();
+                }
+                if (!finishing) {
+                    //still let the downstream writer threads shut down
+                    try {
+                        writer(nullptr);
+                    } catch (...) {}
+                }
+                return;
+            }
+            
+            Logger::Message() << "writer queue: " << num_blocks << " blocks, high water "
+                << std::fixed << std::setprecision(1) << (high_water/1048576.0) << "mb of " << (max_bytes/1048576.0) << "mb"
+                << ", average depth " << (num_blocks>0 ? depth_sum/num_blocks/1048576.0 : 0.0) << "mb"
+                << ", packers blocked " << num_blocked << " times for " << blocked_time << "s";
+            
+            if (stats) {
+                StageCounters queued, blocked, high, depth;
+                queued.calls = num_blocks;
+                blocked.calls = num_blocked;
+                blocked.seconds = blocked_time;
+                high.bytes = high_water;
+                depth.bytes = (num_blocks>0) ? size_t(depth_sum/num_blocks) : 0;
+                stats->add("queue", "", queued);
+                stats->add("queue", "blocked", blocked);
+                stats->add("queue", "high_water", high);
+                stats->add("queue", "average_depth", depth);
+            }
+        }
+};
+
+//packs the blocks from num_channels geometry channels on its own threads,
+//so that packing can be run with a different parallelism. Each thread has
+//its own packer. At most max_inflight blocks are queued: the channels block
+//until one has been packed.
+class CsvBlockPackerStage {
+    public:
+        CsvBlockPackerStage(std::vector<std::shared_ptr<PackCsvBlocks>> packers_, std::function<void(std::shared_ptr<CsvBlock>)> writer_, size_t num_channels_, size_t max_inflight_)
+            : packers(packers_), writer(writer_), num_channels(num_channels_), max_inflight(max_inflight_),
+              inflight(0), channels_done(0), pool(packers_.size()) {}
+        
+        void call(PrimitiveBlockPtr bl) {
+            std::unique_lock<std::mutex> lk(mutex);
+            if (!bl) {
+                channels_done++;
+                if (channels_done < num_channels) {
+                    return;
+                }
+                cond.wait(lk, [this]() { return inflight==0; });
+                auto err = error;
+                lk.unlock();
+                //finish the writer even after an error, so its queue and
+                //connections are closed
+                writer(nullptr);
+                if (err) {
+                    std::rethrow_exception(err);
+                }
+                return;
+            }
+            
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            
+            cond.wait(lk, [this]() { return error || (inflight < max_inflight); });
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            inflight++;
+            lk.unlock();
+            
+            pool.submit([this, bl]() { pack(bl); });
+        }
+        
+    private:
+        std::vector<std::shared_ptr<PackCsvBlocks>> packers;
+        std::function<void(std::shared_ptr<CsvBlock>)> writer;
+        size_t num_channels;
+        size_t max_inflight;
+        
+        std::mutex mutex;
+        std::condition_variable cond;
+        size_t inflight;
+        size_t channels_done;
+        std::exception_ptr error;
+        
+        //declared last, so it is destroyed (joining any pack still
+        //running) before the members pack uses
+        WorkStealingPool pool;
+        
+        void pack(PrimitiveBlockPtr bl) {
+            try {
+                auto cc = packers.at(pool.current_worker())->call(bl);
+                writer(cc);
+            } catch (...) {
+                std::lock_guard<std::mutex> lk(mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lk(mutex);
+                inflight--;
+            }
+            cond.notify_all();
+        }
+};
+
+std::function<void(std::shared_ptr<CsvBlock>)> make_csvblock_writer(
+    const std::string& connection_string, const std::string& table_prfx,
+    bool with_header, bool as_binary,
+    const PostgisWriterOptions& writer_options,
+    const PackCsvBlocks::tagspec& coltags,
+    const std::map<std::string,size_t>& table_connections) {
+    
+    if (table_connections.empty() || (connection_string=="null")) {
+        PostgisWriterOptions options = writer_options;
+        if (writer_options.freeze && (connection_string!="null")) {
+            options.owned_tables = coltags;
+        }
+        return make_postgiswriter_callback(connection_string, table_prfx, with_header,as_binary,options);
+    }
+    
+    auto router = std::make_shared<CsvBlockTableRouter>(connection_string, table_prfx, with_header, as_binary, writer_options, coltags, table_connections);
+    return [router](std::shared_ptr<CsvBlock> bl) { router->call(bl); };
+}
+
 std::vector<block_callback> write_to_postgis_callback(
     std::vector<block_callback> callbacks, size_t numchan,
     const std::string& connection_string, const std::string& table_prfx,
     const PackCsvBlocks::tagspec& coltags,
     bool with_header, bool as_binary,
     table_alloc_func alloc_func,
+    block_table_alloc_func block_alloc_func,
     bool split_multipolygons,
     bool validate_geometry,
-    bool round_geometry) {
+    bool round_geometry,
+    const PostgisWriterOptions& writer_options,
+    const std::map<std::string,size_t>& table_connections,
+    size_t reorder_window,
+    const CoalesceParameters& coalesce,
+    size_t writer_queue_bytes,
+    std::shared_ptr<WorkStealingPool> geometry_pool,
+    size_t geometry_pool_min_points,
+    size_t num_packers,
+    std::shared_ptr<PostgisStats> stats) {
         
     
-    auto writers = multi_threaded_callback<CsvBlock>::make(make_postgiswriter_callback(connection_string, table_prfx, with_header,as_binary), numchan);
+    auto writer = make_csvblock_writer(connection_string, table_prfx, with_header,as_binary,writer_options,coltags,table_connections);
+    writer = make_csvblock_coalesce(writer, with_header, as_binary, coalesce, writer_options.partition_depth);
+    if (reorder_window>0) {
+        //the packed blocks from numchan threads are interleaved: restore
+        //the input order so that each table is written in quadtree order
+        auto reorder = std::make_shared<CsvBlockReorder>(writer, reorder_window);
+        writer = [reorder](std::shared_ptr<CsvBlock> bl) { reorder->call(bl); };
+    }
+    
     //auto writers = threaded_callback<CsvBlock>::make(make_postgiswriter_callback(connection_string, table_prfx, with_header,false), numchan);
     
     std::vector<block_callback> res(numchan);
     
+    if (num_packers>0) {
+        auto queue = std::make_shared<CsvBlockQueue>(writer, 1, writer_queue_bytes, stats);
+        auto writer_q = [queue](std::shared_ptr<CsvBlock> bl) { queue->push(bl); };
+        
+        std::vector<std::shared_ptr<PackCsvBlocks>> packers;
+        for (size_t i=0; i < num_packers; i++) {
+            packers.push_back(make_pack_csvblocks(coltags, with_header, as_binary, alloc_func, split_multipolygons, validate_geometry, round_geometry, geometry_pool, geometry_pool_min_points, block_alloc_func, stats));
+        }
+        auto stage = std::make_shared<CsvBlockPackerStage>(packers, writer_q, numchan, 2*num_packers);
+        Logger::Message() << "packing blocks from " << numchan << " channels with " << num_packers << " packers";
+        
+        for (size_t i=0; i < numchan; i++) {
+            block_callback cb;
+            if (!callbacks.empty()) {
+                cb = callbacks[i];
+            }
+            res[i] = [cb, stage](PrimitiveBlockPtr bl) {
+                if (cb) { cb(bl); }
+                stage->call(bl);
+            };
+        }
+        return res;
+    }
+    
+    auto queue = std::make_shared<CsvBlockQueue>(writer, numchan, writer_queue_bytes, stats);
+    
     for (size_t i=0; i < numchan; i++) {
         
         
-        auto writer_i = writers[i];
+        auto writer_i = [queue](std::shared_ptr<CsvBlock> bl) { queue->push(bl); };
         block_callback cb;
         if (!callbacks.empty()) {
             cb = callbacks[i];
         }
-        res[i]=make_pack_csvblocks_callback(cb, writer_i, coltags, with_header,as_binary,alloc_func,split_multipolygons,validate_geometry, round_geometry);
+        res[i]=make_pack_csvblocks_callback(cb, writer_i, coltags, with_header,as_binary,alloc_func,block_alloc_func,split_multipolygons,validate_geometry, round_geometry, geometry_pool, geometry_pool_min_points, stats);
     }
     
     return res;
@@ -100,23 +615,103 @@ block_callback write_to_postgis_callback_nothread(
     const PackCsvBlocks::tagspec& coltags,
     bool with_header, bool as_binary,
     table_alloc_func alloc_func,
+    block_table_alloc_func block_alloc_func,
     bool split_multipolygons,
     bool validate_geometry,
-    bool round_geometry) {
+    bool round_geometry,
+    const PostgisWriterOptions& writer_options,
+    const std::map<std::string,size_t>& table_connections,
+    const CoalesceParameters& coalesce,
+    std::shared_ptr<PostgisStats> stats) {
         
     
-    auto writer = make_postgiswriter_callback(connection_string, table_prfx,with_header,as_binary);
-    return make_pack_csvblocks_callback(callback,writer,coltags,with_header,as_binary,alloc_func,split_multipolygons,validate_geometry, round_geometry);
+    auto writer = make_csvblock_writer(connection_string, table_prfx,with_header,as_binary,writer_options,coltags,table_connections);
+    writer = make_csvblock_coalesce(writer, with_header, as_binary, coalesce, writer_options.partition_depth);
+    return make_pack_csvblocks_callback(callback,writer,coltags,with_header,as_binary,alloc_func,block_alloc_func,split_multipolygons,validate_geometry, round_geometry,
+        nullptr, 0, stats);
 }
 
 
 
 
+std::shared_ptr<WorkStealingPool> make_geometry_pool(const PostgisParameters& postgis) {
+    if (postgis.geometry_threads==0) {
+        return nullptr;
+    }
+    return std::make_shared<WorkStealingPool>(postgis.geometry_threads);
+}
+
+void prepare_postgis_writer(const PostgisParameters& postgis) {
+    set_csvrows_pool_limit(postgis.buffer_pool_bytes);
+    
+    const auto& opts = postgis.writer_options;
+    if (opts.resume && !opts.commits_enabled()) {
+        throw std::domain_error("resume requires commit_blocks or commit_bytes");
+    }
+    if (opts.resume && postgis.coalesce.enabled()) {
+        //merged blocks depend on timing and on the reorder window, so a
+        //second run may group the tiles differently to the journal
+        throw std::domain_error("resume can't be used with coalesce");
+    }
+    if (opts.resume && (opts.table_mode!=TableLoadMode::Existing)) {
+        //the tables would be emptied while the journal still lists the
+        //blocks already written as committed
+        throw std::domain_error("resume requires table_mode Existing");
+    }
+    if (opts.resume && opts.unlogged) {
+        //an unlogged table is emptied by a crash, but the journal isn't
+        throw std::domain_error("resume can't be used with unlogged");
+    }
+    if ((opts.freeze || opts.unlogged) && (opts.table_mode==TableLoadMode::Existing)) {
+        throw std::domain_error("freeze and unlogged require table_mode Create or Truncate");
+    }
+    if (opts.partition_depth>0) {
+        if (opts.partition_depth>6) {
+            throw std::domain_error("partition_depth must be at most 6");
+        }
+        if (opts.table_mode==TableLoadMode::Existing) {
+            throw std::domain_error("partition_depth requires table_mode Create or Truncate");
+        }
+    }
+    if (opts.freeze) {
+        //COPY FREEZE only applies when the table was created or truncated
+        //in the same transaction
+        if (opts.commits_enabled()) {
+            throw std::domain_error("freeze can't be used with commit_blocks or commit_bytes");
+        }
+        for (const auto& tc: postgis.table_connections) {
+            if (tc.second>1) {
+                throw std::domain_error("freeze requires a single connection per table");
+            }
+        }
+    }
+    
+    if (postgis.connstring=="null") {
+        return;
+    }
+    if (opts.commits_enabled()) {
+        prepare_import_journal(postgis.connstring, postgis.tableprfx, opts.resume);
+    }
+    if ((opts.table_mode!=TableLoadMode::Existing) && !opts.freeze) {
+        prepare_tables(postgis.connstring, postgis.tableprfx, postgis.coltags, opts);
+    }
+}
+
+void finish_postgis_writer(const PostgisParameters& postgis) {
+    if (postgis.connstring=="null") {
+        return;
+    }
+    if (postgis.writer_options.table_mode!=TableLoadMode::Existing) {
+        finish_tables(postgis.connstring, postgis.tableprfx, postgis.coltags, postgis.writer_options);
+    }
+}
+
 mperrorvec process_geometry_postgis(const GeometryParameters& params, const PostgisParameters& postgis, block_callback wrapped) {
     
     if (postgis.connstring.empty()) {
         throw std::domain_error("must specify postgis connection string");
     }
+    prepare_postgis_writer(postgis);
     
     mperrorvec errors_res;
     
@@ -133,7 +728,13 @@ mperrorvec process_geometry_postgis(const GeometryParameters& params, const Post
     }
     
     bool header = (!postgis.use_binary) ? true : false;
-    writer = write_to_postgis_callback(writer, params.numchan, postgis.connstring, postgis.tableprfx, postgis.coltags, header, postgis.use_binary,postgis.alloc_func,postgis.split_multipolygons,postgis.validate_geometry, postgis.round_geometry);
+    auto geometry_pool = make_geometry_pool(postgis);
+    auto writer_options = postgis.writer_options;
+    if (postgis.stats) {
+        writer_options.stats = postgis.stats;
+    }
+    writer = write_to_postgis_callback(writer, params.numchan, postgis.connstring, postgis.tableprfx, postgis.coltags, header, postgis.use_binary,postgis.alloc_func,postgis.block_alloc_func,postgis.split_multipolygons,postgis.validate_geometry, postgis.round_geometry, writer_options, postgis.table_connections, postgis.reorder_window, postgis.coalesce, postgis.writer_queue_bytes,
+        geometry_pool, postgis.geometry_pool_min_points, postgis.num_packers, postgis.stats);
     
     auto addwns = process_geometry_blocks(
             writer, params,
@@ -141,7 +742,10 @@ mperrorvec process_geometry_postgis(const GeometryParameters& params, const Post
     );
     
     read_blocks_merge(params.filenames, addwns, params.locs, params.numchan, nullptr, ReadBlockFlags::Empty, 1<<14);
-      
+    finish_postgis_writer(postgis);
+    if (postgis.stats) {
+        Logger::Message() << postgis.stats->summary();
+    }
     
     return errors_res;
 
@@ -154,6 +758,7 @@ mperrorvec process_geometry_postgis_nothread(const GeometryParameters& params, c
     if (postgis.connstring.empty()) {
         throw std::domain_error("must specify postgis connection string");
     }
+    prepare_postgis_writer(postgis);
     
     mperrorvec errors_res;
     
@@ -166,7 +771,11 @@ mperrorvec process_geometry_postgis_nothread(const GeometryParameters& params, c
    
     
     bool header = (!postgis.use_binary) ? true : false;
-    writer = write_to_postgis_callback_nothread(writer, postgis.connstring, postgis.tableprfx, postgis.coltags, header, postgis.use_binary,postgis.alloc_func,postgis.split_multipolygons,postgis.validate_geometry, postgis.round_geometry);
+    auto writer_options = postgis.writer_options;
+    if (postgis.stats) {
+        writer_options.stats = postgis.stats;
+    }
+    writer = write_to_postgis_callback_nothread(writer, postgis.connstring, postgis.tableprfx, postgis.coltags, header, postgis.use_binary,postgis.alloc_func,postgis.block_alloc_func,postgis.split_multipolygons,postgis.validate_geometry, postgis.round_geometry, writer_options, postgis.table_connections, postgis.coalesce, postgis.stats);
     
     block_callback addwns = process_geometry_blocks_nothread(
             writer, params,
@@ -174,7 +783,10 @@ mperrorvec process_geometry_postgis_nothread(const GeometryParameters& params, c
     );
     
     read_blocks_merge_nothread(params.filenames, addwns, params.locs, nullptr, ReadBlockFlags::Empty);
-      
+    finish_postgis_writer(postgis);
+    if (postgis.stats) {
+        Logger::Message() << postgis.stats->summary();
+    }
     
     return errors_res;
 
@@ -197,8 +809,12 @@ mperrorvec process_geometry_csvcallback(const GeometryParameters& params,
         
     
     mperrorvec errors_res;
+    set_csvrows_pool_limit(postgis.buffer_pool_bytes);
     
-    auto cb=make_pack_csvblocks_callback(callback,csvblock_callback,postgis.coltags, true, postgis.use_binary,postgis.alloc_func,postgis.split_multipolygons,postgis.validate_geometry, postgis.round_geometry);
+    auto coalesced = make_csvblock_coalesce(csvblock_callback, true, postgis.use_binary, postgis.coalesce, 0);
+    auto geometry_pool = make_geometry_pool(postgis);
+    auto cb=make_pack_csvblocks_callback(callback,coalesced,postgis.coltags, true, postgis.use_binary,postgis.alloc_func,postgis.block_alloc_func,postgis.split_multipolygons,postgis.validate_geometry, postgis.round_geometry,
+        geometry_pool, postgis.geometry_pool_min_points, postgis.stats);
     auto csvcallback = multi_threaded_callback<PrimitiveBlock>::make(cb,params.numchan);
        
     
@@ -220,8 +836,11 @@ mperrorvec process_geometry_csvcallback_nothread(const GeometryParameters& param
         
     
     mperrorvec errors_res;
+    set_csvrows_pool_limit(postgis.buffer_pool_bytes);
     
-    block_callback csvcallback = make_pack_csvblocks_callback(callback,csvblock_callback,postgis.coltags, true, postgis.use_binary,postgis.alloc_func,postgis.split_multipolygons,postgis.validate_geometry, postgis.round_geometry);
+    auto coalesced = make_csvblock_coalesce(csvblock_callback, true, postgis.use_binary, postgis.coalesce, 0);
+    block_callback csvcallback = make_pack_csvblocks_callback(callback,coalesced,postgis.coltags, true, postgis.use_binary,postgis.alloc_func,postgis.block_alloc_func,postgis.split_multipolygons,postgis.validate_geometry, postgis.round_geometry,
+        nullptr, 0, postgis.stats);
     
     block_callback addwns = process_geometry_blocks_nothread(
             csvcallback, params,
@@ -30,10 +30,24 @@ namespace oqt {
 namespace geometry {
 
 
+struct CoalesceParameters {
+    CoalesceParameters() : max_bytes(0), max_rows(0), max_seconds(0) {}
+    
+    //merge consecutive blocks for each table until one of these is reached.
+    //Zero for no limit: coalescing is disabled if all are zero.
+    size_t max_bytes;
+    size_t max_rows;
+    
+    //checked when the next block arrives
+    double max_seconds;
+    
+    bool enabled() const { return (max_bytes>0) || (max_rows>0) || (max_seconds>0); }
+};
+
 struct PostgisParameters {
     
     PostgisParameters()
-        : connstring(""), tableprfx(""), use_binary(false), alloc_func(default_table_alloc), split_multipolygons(false), validate_geometry(false), round_geometry(false) {}
+        : connstring(""), tableprfx(""), use_binary(false), alloc_func(default_table_alloc), split_multipolygons(false), validate_geometry(false), round_geometry(false), reorder_window(0), writer_queue_bytes(512*1024*1024), buffer_pool_bytes(256*1024*1024), geometry_threads(0), geometry_pool_min_points(10000), num_packers(0) {}
         
     
     std::string connstring;
@@ -42,9 +56,47 @@ struct PostgisParameters {
     bool use_binary;
     table_alloc_func alloc_func;
     
+    //if set, called once for each block in place of alloc_func
+    block_table_alloc_func block_alloc_func;
+    
     bool split_multipolygons;
     bool validate_geometry;
     bool round_geometry;
+    
+    PostgisWriterOptions writer_options;
+    
+    //number of writer connections for each table. If empty, one writer
+    //receives the rows for all tables
+    std::map<std::string,size_t> table_connections;
+    
+    //number of blocks held back to pass the packed blocks to the writers
+    //in the original (quadtree) order. Zero to write blocks as soon as
+    //they are packed. The held blocks aren't counted in writer_queue_bytes.
+    size_t reorder_window;
+    
+    CoalesceParameters coalesce;
+    
+    //limit on the packed data waiting for the writers: the packing
+    //threads block when this is reached
+    size_t writer_queue_bytes;
+    
+    //limit on the memory kept for reuse by CsvRows once written
+    size_t buffer_pool_bytes;
+    
+    //threads shared by all the packers for geometries with at least
+    //geometry_pool_min_points points which need geos (validation, rounding,
+    //representative points or boundary lines). Zero to prepare each
+    //geometry on the packer's own thread.
+    size_t geometry_threads;
+    size_t geometry_pool_min_points;
+    
+    //threads packing the blocks from the geometry channels into rows.
+    //Zero to pack on the geometry channel threads.
+    size_t num_packers;
+    
+    //if set, the packing and writing stages add their timings and the rows
+    //and bytes for each table to stats
+    std::shared_ptr<PostgisStats> stats;
 };
 
 
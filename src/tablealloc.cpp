@@ -0,0 +1,262 @@
+/*****************************************************************************
+ *
+ * This file is part of osmquadtreepostgis
+ *
+ * Copyright (C) 2019 James Harris
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#include "tablealloc.hpp"
+
+#include "oqt/geometry/elements/linestring.hpp"
+#include "oqt/geometry/elements/simplepolygon.hpp"
+#include "oqt/geometry/elements/complicatedpolygon.hpp"
+#include "oqt/utils/logger.hpp"
+
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+
+namespace oqt {
+namespace geometry {
+
+namespace {
+
+const std::vector<ElementType> geometry_types{
+    ElementType::Point, ElementType::Linestring,
+    ElementType::SimplePolygon, ElementType::ComplicatedPolygon};
+
+struct CompiledPredicate {
+    size_t slot;
+    TagPredicateOp op;
+    std::vector<std::string> values;
+
+    bool match(const std::string* val) const {
+        switch (op) {
+            case TagPredicateOp::Exists: return val!=nullptr;
+            case TagPredicateOp::Missing: return val==nullptr;
+            case TagPredicateOp::Equals:
+                return val && (std::find(values.begin(), values.end(), *val) != values.end());
+            case TagPredicateOp::NotEquals:
+                return val && (std::find(values.begin(), values.end(), *val) == values.end());
+        }
+        return false;
+    }
+};
+
+struct CompiledRule {
+    size_t index;
+    std::vector<CompiledPredicate> tags;
+    std::optional<bool> has_zorder;
+    double min_measure, max_measure;
+    bool needs_measure;
+};
+
+//z_order and area or length, only fetched if a rule needs them
+struct ElementMeasures {
+    ElementMeasures(ElementPtr ele_) : ele(ele_), fetched(false), measure(0) {}
+
+    void fetch() {
+        if (fetched) { return; }
+        fetched=true;
+        if (ele->Type()==ElementType::Linestring) {
+            auto ln = std::dynamic_pointer_cast<Linestring>(ele);
+            zorder = ln->ZOrder();
+            measure = ln->Length();
+        } else if (ele->Type()==ElementType::SimplePolygon) {
+            auto py = std::dynamic_pointer_cast<SimplePolygon>(ele);
+            zorder = py->ZOrder();
+            measure = py->Area();
+        } else if (ele->Type()==ElementType::ComplicatedPolygon) {
+            auto py = std::dynamic_pointer_cast<ComplicatedPolygon>(ele);
+            zorder = py->ZOrder();
+            measure = py->Area();
+        }
+    }
+
+    ElementPtr ele;
+    bool fetched;
+    std::optional<int64> zorder;
+    double measure;
+};
+
+class RuleTableAlloc : public TableIdAlloc, public std::enable_shared_from_this<RuleTableAlloc> {
+    public:
+        RuleTableAlloc(const std::vector<TableAllocRule>& rules) {
+            for (size_t i=0; i < rules.size(); i++) {
+                for (auto ty: (rules[i].types.empty() ? geometry_types : rules[i].types)) {
+                    by_type[ty].push_back(compile(rules[i], i, ty));
+                }
+                rule_tables.push_back(rules[i].tables);
+            }
+        }
+
+        std::vector<std::string> call(ElementPtr ele) const {
+            int r = find_rule(ele);
+            if (r < 0) {
+                return {};
+            }
+            return rule_tables[r];
+        }
+
+        table_id_alloc_func resolve(const table_names& tables) const {
+            std::vector<table_set> rule_ids;
+            for (const auto& tt: rule_tables) {
+                table_set ids;
+                for (const auto& tab: tt) {
+                    auto it = std::find(tables.begin(), tables.end(), tab);
+                    if (it==tables.end()) {
+                        Logger::Message() << "unknown table " << tab;
+                        continue;
+                    }
+                    ids.set(it-tables.begin());
+                }
+                rule_ids.push_back(ids);
+            }
+
+            auto self = shared_from_this();
+            return [self, rule_ids](ElementPtr ele) {
+                int r = self->find_rule(ele);
+                if (r < 0) {
+                    return table_set();
+                }
+                return rule_ids[r];
+            };
+        }
+
+    private:
+        //index of the first matching rule, or -1
+        int find_rule(ElementPtr ele) const {
+            auto it = by_type.find(ele->Type());
+            if (it==by_type.end()) {
+                return -1;
+            }
+
+            //one pass over the tags finds the value of every key used
+            thread_local std::vector<const std::string*> vals;
+            vals.assign(keys.size(), nullptr);
+            if (!keys.empty()) {
+                for (const auto& tg: ele->Tags()) {
+                    auto kt = keys.find(tg.key);
+                    if ((kt!=keys.end()) && !vals[kt->second]) {
+                        vals[kt->second] = &tg.val;
+                    }
+                }
+            }
+
+            ElementMeasures measures(ele);
+            for (const auto& rule: it->second) {
+                if (match(rule, vals, measures)) {
+                    return rule.index;
+                }
+            }
+            return -1;
+        }
+
+        CompiledRule compile(const TableAllocRule& rule, size_t index, ElementType ty) {
+            CompiledRule result;
+            result.index = index;
+            for (const auto& tp: rule.tags) {
+                auto kt = keys.emplace(tp.key, keys.size()).first;
+                result.tags.push_back(CompiledPredicate{kt->second, tp.op, tp.values});
+            }
+            result.has_zorder = rule.has_zorder;
+            if (ty==ElementType::Linestring) {
+                result.min_measure = rule.min_length;
+                result.max_measure = rule.max_length;
+            } else {
+                result.min_measure = rule.min_area;
+                result.max_measure = rule.max_area;
+            }
+            result.needs_measure = (result.min_measure>0) || (result.max_measure>0);
+
+            //a point has no z_order or measure, and a polygon no length
+            bool has_measure = (ty!=ElementType::Point);
+            bool wrong_limit = (ty==ElementType::Linestring)
+                ? ((rule.min_area>0) || (rule.max_area>0))
+                : ((rule.min_length>0) || (rule.max_length>0));
+            if ((!has_measure && (result.needs_measure || (rule.has_zorder && *rule.has_zorder))) || wrong_limit) {
+                never_match(result);
+            }
+            if (!has_measure) {
+                result.has_zorder.reset();
+            }
+            return result;
+        }
+
+        void never_match(CompiledRule& rule) {
+            rule.min_measure = 1;
+            rule.max_measure = -1;
+            rule.needs_measure = true;
+        }
+
+        bool match(const CompiledRule& rule, const std::vector<const std::string*>& vals, ElementMeasures& measures) const {
+            for (const auto& tp: rule.tags) {
+                if (!tp.match(vals[tp.slot])) {
+                    return false;
+                }
+            }
+            if (rule.has_zorder || rule.needs_measure) {
+                measures.fetch();
+            }
+            if (rule.has_zorder && (*rule.has_zorder != bool(measures.zorder))) {
+                return false;
+            }
+            if ((rule.min_measure>0) && (measures.measure < rule.min_measure)) {
+                return false;
+            }
+            if ((rule.max_measure!=0) && (measures.measure > rule.max_measure)) {
+                return false;
+            }
+            return true;
+        }
+
+        std::unordered_map<std::string,size_t> keys;
+        std::map<ElementType,std::vector<CompiledRule>> by_type;
+        std::vector<std::vector<std::string>> rule_tables;
+};
+
+}
+
+table_alloc_func make_rule_table_alloc(const std::vector<TableAllocRule>& rules) {
+    return make_table_alloc_func(std::make_shared<RuleTableAlloc>(rules));
+}
+
+std::vector<TableAllocRule> extended_table_alloc_rules() {
+    std::vector<TableAllocRule> rules;
+
+    rules.push_back(TableAllocRule({ElementType::Point}, {}, {"point"}));
+
+    TableAllocRule highway({ElementType::Linestring}, {}, {"highway"});
+    highway.has_zorder = true;
+    rules.push_back(highway);
+    rules.push_back(TableAllocRule({ElementType::Linestring}, {}, {"line"}));
+
+    rules.push_back(TableAllocRule({ElementType::ComplicatedPolygon},
+        {TagPredicate("type", TagPredicateOp::Equals, {"boundary"})},
+        {"polygon","boundary"}));
+
+    rules.push_back(TableAllocRule({ElementType::SimplePolygon, ElementType::ComplicatedPolygon},
+        {TagPredicate("building", TagPredicateOp::NotEquals, {"no"})},
+        {"building"}));
+    rules.push_back(TableAllocRule({ElementType::SimplePolygon, ElementType::ComplicatedPolygon}, {}, {"polygon"}));
+
+    return rules;
+}
+
+}
+}
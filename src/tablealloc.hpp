@@ -0,0 +1,83 @@
+/*****************************************************************************
+ *
+ * This file is part of osmquadtreepostgis
+ *
+ * Copyright (C) 2019 James Harris
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef OSMQUADTREEPOSTGIS_TABLEALLOC_HPP
+#define OSMQUADTREEPOSTGIS_TABLEALLOC_HPP
+
+#include "postgiswriter.hpp"
+
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace oqt {
+namespace geometry {
+
+enum class TagPredicateOp {
+    Exists,
+    Missing,
+    Equals,     //tag present with one of values
+    NotEquals   //tag present with none of values
+};
+
+struct TagPredicate {
+    TagPredicate() : op(TagPredicateOp::Exists) {}
+    TagPredicate(const std::string& key_, TagPredicateOp op_, const std::vector<std::string>& values_)
+        : key(key_), op(op_), values(values_) {}
+
+    std::string key;
+    TagPredicateOp op;
+    std::vector<std::string> values;
+};
+
+//an element matching all the conditions is written to tables. The rules
+//are tried in order and the first match wins; an element which matches
+//no rule is not written.
+struct TableAllocRule {
+    TableAllocRule() : min_area(0), max_area(0), min_length(0), max_length(0) {}
+    TableAllocRule(const std::vector<ElementType>& types_, const std::vector<TagPredicate>& tags_, const std::vector<std::string>& tables_)
+        : types(types_), tags(tags_), min_area(0), max_area(0), min_length(0), max_length(0), tables(tables_) {}
+
+    //empty for any geometry type
+    std::vector<ElementType> types;
+    std::vector<TagPredicate> tags;
+
+    //linestrings and polygons only: set to require (or exclude) a z_order
+    std::optional<bool> has_zorder;
+
+    //zero for no limit. Area applies to polygons and length to linestrings:
+    //other types never match a rule with these set.
+    double min_area, max_area;
+    double min_length, max_length;
+
+    std::vector<std::string> tables;
+};
+
+table_alloc_func make_rule_table_alloc(const std::vector<TableAllocRule>& rules);
+
+//points to point, linestrings to highway (with a z_order) or line, polygons
+//to building or polygon, and boundary relations to polygon and boundary
+std::vector<TableAllocRule> extended_table_alloc_rules();
+
+}
+}
+#endif
@@ -21,20 +21,51 @@
  *****************************************************************************/
 
 #include "validategeoms.hpp"
+#include "oqt/geometry/utils.hpp"
 #include <oqt/utils/pbf/fixedint.hpp>
 #include "geos_c.h"
 
+#include <algorithm>
+#include <cmath>
+
+#if (GEOS_VERSION_MAJOR > 3) || ((GEOS_VERSION_MAJOR == 3) && (GEOS_VERSION_MINOR >= 10))
+#define GEOS_HAS_COPY_FROM_BUFFER
+#endif
+
 namespace oqt {
 namespace geometry {
     
+//a geos context for each thread, with a wkb writer set up to write ewkb,
+//and a buffer for coordinates
+class GeosContext {
+    public:
+        GeosContext() {
+            handle = GEOS_init_r();
+            writer = GEOSWKBWriter_create_r(handle);
+            GEOSWKBWriter_setIncludeSRID_r(handle, writer, 1);
+            GEOSWKBWriter_setByteOrder_r(handle, writer, GEOS_WKB_XDR);
+        }
+        
+        ~GeosContext() {
+            GEOSWKBWriter_destroy_r(handle, writer);
+            GEOS_finish_r(handle);
+        }
+        
+        GEOSContextHandle_t handle;
+        GEOSWKBWriter* writer;
+        std::vector<double> coords;
+};
+
+//geometries keep hold of the context, so that it stays alive if the
+//thread finishes first
+std::shared_ptr<GeosContext> thread_geos_context() {
+    thread_local std::shared_ptr<GeosContext> context = std::make_shared<GeosContext>();
+    return context;
+}
     
 class GeosGeometryImpl : public GeosGeometry {
     public:
-        GeosGeometryImpl(std::shared_ptr<oqt::BaseGeometry> geom, bool round) {
-            
-            handle = GEOS_init_r();
-            
-            
+        GeosGeometryImpl(std::shared_ptr<oqt::BaseGeometry> geom, bool round) : context(thread_geos_context()), handle(context->handle) {
             
             if (geom->Type() == oqt::ElementType::Point) {
                 geometry = make_point(std::dynamic_pointer_cast<Point>(geom), round);
@@ -49,8 +80,7 @@ class GeosGeometryImpl : public GeosGeometry {
             }
         }
         
-        GeosGeometryImpl(std::shared_ptr<ComplicatedPolygon> geom, size_t part, bool round) {
-            handle = GEOS_init_r();
+        GeosGeometryImpl(std::shared_ptr<ComplicatedPolygon> geom, size_t part, bool round) : context(thread_geos_context()), handle(context->handle) {
             geometry = make_complicatedpolygon_part(geom->Parts().at(part), round);
         }
         
@@ -58,7 +88,6 @@ class GeosGeometryImpl : public GeosGeometry {
             if (geometry) {
                 GEOSGeom_destroy_r(handle, geometry);
             }
-            GEOS_finish_r(handle);
         };
         
         void validate() {
@@ -71,12 +100,19 @@ class GeosGeometryImpl : public GeosGeometry {
             int t = GEOSGeomTypeId_r(handle,geometry);
             if ((t==3) || (t==6)) {
                 if (!GEOSisValid_r(handle, geometry)) {
-                    GEOSGeometry* result = GEOSBuffer_r(handle, geometry, 0, 16);
-            
-                    if (result) {
-                        GEOSGeom_destroy_r(handle, geometry);
-                        geometry=result;
-                    }
+                    make_valid();
+                }
+            }
+        }
+        
+        void make_valid() {
+            int t = GEOSGeomTypeId_r(handle,geometry);
+            if ((t==3) || (t==6)) {
+                GEOSGeometry* result = GEOSBuffer_r(handle, geometry, 0, 16);
+                
+                if (result) {
+                    GEOSGeom_destroy_r(handle, geometry);
+                    geometry=result;
                 }
             }
         }
@@ -109,6 +145,7 @@ class GeosGeometryImpl : public GeosGeometry {
         }
     
     private:
+        std::shared_ptr<GeosContext> context;
         GEOSContextHandle_t handle;
         GEOSGeometry* geometry;
         
@@ -117,21 +154,15 @@ class GeosGeometryImpl : public GeosGeometry {
             //GEOS_setWKBByteOrder_r(handle, GEOS_WKB_XDR);
             GEOSSetSRID_r(handle, geom, 3857);
             
-            GEOSWKBWriter* writer = GEOSWKBWriter_create_r(handle);
-            GEOSWKBWriter_setIncludeSRID_r(handle, writer, 1);
-            GEOSWKBWriter_setByteOrder_r(handle, writer, GEOS_WKB_XDR);
-            
-            
             std::string s;            
             size_t sz;
-            unsigned char* c = GEOSWKBWriter_write_r(handle, writer, geom, &sz);
+            unsigned char* c = GEOSWKBWriter_write_r(handle, context->writer, geom, &sz);
             
             
             if (c) {
                 s = std::string(reinterpret_cast<const char*>(c), sz);
                 GEOSFree_r(handle, c);
             }
-            GEOSWKBWriter_destroy_r(handle, writer);
             return s;
             
             
@@ -146,7 +177,20 @@ class GeosGeometryImpl : public GeosGeometry {
         }
         
         GEOSCoordSequence* make_coords(const std::vector<LonLat>& lls, bool round) {
-            
+#ifdef GEOS_HAS_COPY_FROM_BUFFER
+            auto& buf = context->coords;
+            buf.resize(lls.size()*2);
+            for (size_t i=0; i < lls.size(); i++) {
+                const auto& ll = lls[i];
+                auto p = forward_transform(ll.lon, ll.lat);
+                if (round) {
+                    p = p.round_2dp();
+                }
+                buf[2*i] = p.x;
+                buf[2*i+1] = p.y;
+            }
+            return GEOSCoordSeq_copyFromBuffer_r(handle, buf.data(), lls.size(), 0, 0);
+#else
             GEOSCoordSequence* coords = GEOSCoordSeq_create_r(handle, lls.size(), 2);
             for (size_t i=0; i < lls.size(); i++) {
                 const auto& ll = lls[i];
@@ -158,6 +202,7 @@ class GeosGeometryImpl : public GeosGeometry {
                 GEOSCoordSeq_setY_r(handle, coords, i, p.y);
             }
             return coords;
+#endif
         }
         
         GEOSGeometry* make_linestring(std::shared_ptr<Linestring> line, bool round) {
@@ -201,6 +246,350 @@ class GeosGeometryImpl : public GeosGeometry {
               
 };
 
+//sign of the cross product (b-a)x(c-a): 1 or -1, 0 if collinear, or
+//Uncertain when too close to zero to trust the rounding.
+const int Uncertain = 2;
+
+int orientation(const XY& a, const XY& b, const XY& c) {
+    double l = (b.x-a.x)*(c.y-a.y);
+    double r = (b.y-a.y)*(c.x-a.x);
+    double det = l-r;
+    double err = 1e-12 * (std::fabs(l)+std::fabs(r));
+    
+    if (det > err) { return 1; }
+    if (det < -err) { return -1; }
+    if ((l==0) && (r==0)) { return 0; }
+    return Uncertain;
+}
+
+bool in_box(const XY& a, const XY& b, const XY& p) {
+    return (p.x >= std::min(a.x,b.x)) && (p.x <= std::max(a.x,b.x))
+        && (p.y >= std::min(a.y,b.y)) && (p.y <= std::max(a.y,b.y));
+}
+
+//checks polygon rings using a sweep over the segments, ordered by min x.
+//Anything it can't be sure of (touching rings, holes outside their
+//shell, nearly collinear segments) is left to geos.
+class ValidityChecker {
+    public:
+        ValidityChecker(bool round_) : round(round_), invalid(false), ambiguous(false) {}
+        
+        void add_ring(const std::vector<LonLat>& lls, size_t part, bool is_outer) {
+            Ring rr;
+            rr.part = part;
+            rr.outer = is_outer;
+            rr.first = points.size();
+            
+            for (const auto& ll: lls) {
+                auto p = forward_transform(ll.lon, ll.lat);
+                if (round) {
+                    p = p.round_2dp();
+                }
+                if (!std::isfinite(p.x) || !std::isfinite(p.y)) {
+                    ambiguous=true;
+                    return;
+                }
+                //repeated points are allowed
+                if ((points.size() > rr.first) && (points.back().x==p.x) && (points.back().y==p.y)) {
+                    continue;
+                }
+                points.push_back(p);
+            }
+            rr.num = points.size()-rr.first;
+            
+            //rings must be closed, with at least three distinct points
+            if ((rr.num < 4) || (points[rr.first].x!=points.back().x) || (points[rr.first].y!=points.back().y)) {
+                invalid=true;
+                return;
+            }
+            
+            //and must enclose some area
+            double area=0;
+            rr.minx=points[rr.first].x; rr.maxx=rr.minx;
+            rr.miny=points[rr.first].y; rr.maxy=rr.miny;
+            for (size_t i=rr.first; i < rr.first+rr.num-1; i++) {
+                const auto& a = points[i];
+                const auto& b = points[i+1];
+                area += a.x*b.y - b.x*a.y;
+                rr.minx = std::min(rr.minx, b.x); rr.maxx = std::max(rr.maxx, b.x);
+                rr.miny = std::min(rr.miny, b.y); rr.maxy = std::max(rr.maxy, b.y);
+                
+                segments.push_back(Segment{i, rings.size(), std::min(a.x,b.x), std::max(a.x,b.x)});
+            }
+            if (area==0) {
+                invalid=true;
+                return;
+            }
+            rings.push_back(rr);
+        }
+        
+        GeometryValidity check() {
+            if (invalid) { return GeometryValidity::Invalid; }
+            if (ambiguous || rings.empty()) { return GeometryValidity::Ambiguous; }
+            
+            std::sort(segments.begin(), segments.end(), [](const Segment& l, const Segment& r) { return l.minx < r.minx; });
+            
+            for (size_t i=0; i < segments.size(); i++) {
+                for (size_t j=i+1; (j < segments.size()) && (segments[j].minx <= segments[i].maxx); j++) {
+                    check_pair(segments[i], segments[j]);
+                    if (invalid) { return GeometryValidity::Invalid; }
+                }
+            }
+            if (ambiguous) { return GeometryValidity::Ambiguous; }
+            
+            //the rings don't touch: each hole must be inside its shell, and
+            //no ring may be inside another hole or another shell
+            if (rings.size() > max_nested_rings) {
+                return GeometryValidity::Ambiguous;
+            }
+            for (size_t i=0; i < rings.size(); i++) {
+                for (size_t j=0; j < rings.size(); j++) {
+                    if (i==j) { continue; }
+                    const auto& ri = rings[i];
+                    const auto& rj = rings[j];
+                    bool expect_inside = (!ri.outer) && rj.outer && (ri.part==rj.part);
+                    if (expect_inside || (rj.outer==ri.outer)) {
+                        if (inside(points[ri.first], rj) != expect_inside) {
+                            return GeometryValidity::Ambiguous;
+                        }
+                    }
+                }
+            }
+            if (ambiguous) { return GeometryValidity::Ambiguous; }
+            return GeometryValidity::Valid;
+        }
+        
+    private:
+        struct Ring {
+            size_t part;
+            bool outer;
+            size_t first;
+            size_t num;
+            double minx, miny, maxx, maxy;
+        };
+        
+        struct Segment {
+            size_t start;
+            size_t ring;
+            double minx, maxx;
+        };
+        
+        static const size_t max_nested_rings = 256;
+        
+        bool round;
+        bool invalid;
+        bool ambiguous;
+        std::vector<XY> points;
+        std::vector<Ring> rings;
+        std::vector<Segment> segments;
+        
+        void check_pair(const Segment& l, const Segment& r) {
+            const XY& p1 = points[l.start];
+            const XY& p2 = points[l.start+1];
+            const XY& q1 = points[r.start];
+            const XY& q2 = points[r.start+1];
+            
+            if ((std::max(p1.y,p2.y) < std::min(q1.y,q2.y)) || (std::max(q1.y,q2.y) < std::min(p1.y,p2.y))) {
+                return;
+            }
+            
+            if (l.ring==r.ring) {
+                const auto& rr = rings[l.ring];
+                size_t last = rr.first+rr.num-2;
+                size_t a = std::min(l.start, r.start);
+                size_t b = std::max(l.start, r.start);
+                
+                //adjacent segments share a point, but mustn't fold back
+                //over each other
+                if (b==(a+1)) {
+                    check_adjacent(points[b], points[a], points[b+1]);
+                    return;
+                }
+                if ((a==rr.first) && (b==last)) {
+                    check_adjacent(points[a], points[a+1], points[b]);
+                    return;
+                }
+            }
+            
+            if (intersects(p1, p2, q1, q2)) {
+                //a ring touching itself is always invalid, but rings can
+                //touch each other at a point
+                if (l.ring==r.ring) {
+                    invalid=true;
+                } else {
+                    ambiguous=true;
+                }
+            }
+        }
+        
+        void check_adjacent(const XY& shared, const XY& a, const XY& b) {
+            int o = orientation(shared, a, b);
+            if (o==Uncertain) {
+                ambiguous=true;
+            } else if ((o==0) && ((((a.x-shared.x)*(b.x-shared.x)) + ((a.y-shared.y)*(b.y-shared.y))) > 0)) {
+                invalid=true;
+            }
+        }
+        
+        bool intersects(const XY& p1, const XY& p2, const XY& q1, const XY& q2) {
+            int o1 = orientation(p1, p2, q1);
+            int o2 = orientation(p1, p2, q2);
+            int o3 = orientation(q1, q2, p1);
+            int o4 = orientation(q1, q2, p2);
+            if ((o1==Uncertain) || (o2==Uncertain) || (o3==Uncertain) || (o4==Uncertain)) {
+                ambiguous=true;
+                return false;
+            }
+            
+            if ((o1*o2 < 0) && (o3*o4 < 0)) { return true; }
+            
+            if ((o1==0) && in_box(p1, p2, q1)) { return true; }
+            if ((o2==0) && in_box(p1, p2, q2)) { return true; }
+            if ((o3==0) && in_box(q1, q2, p1)) { return true; }
+            if ((o4==0) && in_box(q1, q2, p2)) { return true; }
+            return false;
+        }
+        
+        //winding number test
+        bool inside(const XY& p, const Ring& rr) {
+            if ((p.x < rr.minx) || (p.x > rr.maxx) || (p.y < rr.miny) || (p.y > rr.maxy)) {
+                return false;
+            }
+            
+            int wn=0;
+            for (size_t i=rr.first; i < rr.first+rr.num-1; i++) {
+                const auto& a = points[i];
+                const auto& b = points[i+1];
+                if ((a.y <= p.y) == (b.y <= p.y)) {
+                    continue;
+                }
+                int o = orientation(a, b, p);
+                if (o==Uncertain) {
+                    ambiguous=true;
+                } else if ((a.y <= p.y) && (o > 0)) {
+                    wn++;
+                } else if ((a.y > p.y) && (o < 0)) {
+                    wn--;
+                }
+            }
+            return wn!=0;
+        }
+};
+
+void add_polygon_part(ValidityChecker& checker, const PolygonPart& part, size_t idx) {
+    checker.add_ring(ringpart_lonlats(part.outer), idx, true);
+    for (const auto& inn: part.inners) {
+        checker.add_ring(ringpart_lonlats(inn), idx, false);
+    }
+}
+
+GeometryValidity check_validity(std::shared_ptr<BaseGeometry> ele, bool round) {
+    //geos validation only changes polygons
+    if (ele->Type() == oqt::ElementType::Point) { return GeometryValidity::Valid; }
+    if (ele->Type() == oqt::ElementType::Linestring) { return GeometryValidity::Valid; }
+    
+    ValidityChecker checker(round);
+    if (ele->Type() == oqt::ElementType::SimplePolygon) {
+        checker.add_ring(std::dynamic_pointer_cast<SimplePolygon>(ele)->LonLats(), 0, true);
+    } else if (ele->Type() == oqt::ElementType::ComplicatedPolygon) {
+        auto poly = std::dynamic_pointer_cast<ComplicatedPolygon>(ele);
+        for (size_t i=0; i < poly->Parts().size(); i++) {
+            add_polygon_part(checker, poly->Parts()[i], i);
+        }
+    }
+    return checker.check();
+}
+
+GeometryValidity check_validity_cp_part(std::shared_ptr<ComplicatedPolygon> ele, size_t part, bool round) {
+    ValidityChecker checker(round);
+    add_polygon_part(checker, ele->Parts().at(part), 0);
+    return checker.check();
+}
+
+DerivedGeometry::DerivedGeometry(std::shared_ptr<BaseGeometry> ele_, int part_, bool validate_, bool round_)
+    : ele(ele_), part(part_), validate(validate_), round(round_) {}
+
+const std::string& DerivedGeometry::Wkb() {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (!wkb) {
+        if (part >= 0) {
+            auto cp = std::dynamic_pointer_cast<ComplicatedPolygon>(ele);
+            wkb = polygon_part_wkb(cp->Parts().at(part), true, true);
+        } else {
+            wkb = ele->Wkb(true, true);
+        }
+    }
+    return *wkb;
+}
+
+GeometryValidity DerivedGeometry::Validity() {
+    std::lock_guard<std::mutex> lk(mutex);
+    return check_validity_locked();
+}
+
+const std::string& DerivedGeometry::GeosWkb() {
+    std::lock_guard<std::mutex> lk(mutex);
+    prepare_geos_locked(true, false, false);
+    return *geos_wkb;
+}
+
+const std::string& DerivedGeometry::PointWkb() {
+    std::lock_guard<std::mutex> lk(mutex);
+    prepare_geos_locked(false, true, false);
+    return *point_wkb;
+}
+
+const std::string& DerivedGeometry::BoundaryLineWkb() {
+    std::lock_guard<std::mutex> lk(mutex);
+    prepare_geos_locked(false, false, true);
+    return *boundary_line_wkb;
+}
+
+void DerivedGeometry::PrepareGeos(bool geom, bool point, bool boundary_line) {
+    std::lock_guard<std::mutex> lk(mutex);
+    prepare_geos_locked(geom, point, boundary_line);
+}
+
+GeometryValidity DerivedGeometry::check_validity_locked() {
+    if (!validity) {
+        if (part >= 0) {
+            validity = check_validity_cp_part(std::dynamic_pointer_cast<ComplicatedPolygon>(ele), part, round);
+        } else {
+            validity = check_validity(ele, round);
+        }
+    }
+    return *validity;
+}
+
+void DerivedGeometry::prepare_geos_locked(bool geom, bool point, bool boundary_line) {
+    geom = geom && !geos_wkb;
+    point = point && !point_wkb;
+    boundary_line = boundary_line && !boundary_line_wkb;
+    if (!geom && !point && !boundary_line) {
+        return;
+    }
+    
+    std::shared_ptr<GeosGeometry> geos;
+    if (part >= 0) {
+        geos = make_geos_geometry_cp_part(std::dynamic_pointer_cast<ComplicatedPolygon>(ele), part, round);
+    } else {
+        geos = make_geos_geometry(ele, round);
+    }
+    
+    if (validate) {
+        auto v = check_validity_locked();
+        if (v==GeometryValidity::Invalid) {
+            geos->make_valid();
+        } else if (v==GeometryValidity::Ambiguous) {
+            geos->validate();
+        }
+    }
+    
+    if (geom) { geos_wkb = geos->Wkb(); }
+    if (point) { point_wkb = geos->PointWkb(); }
+    if (boundary_line) { boundary_line_wkb = geos->BoundaryLineWkb(); }
+}
+
 std::shared_ptr<GeosGeometry> make_geos_geometry(std::shared_ptr<BaseGeometry> ele, bool round) { return std::make_shared<GeosGeometryImpl>(ele,round); }
 std::shared_ptr<GeosGeometry> make_geos_geometry_cp_part(std::shared_ptr<ComplicatedPolygon> ele, size_t part, bool round) { return std::make_shared<GeosGeometryImpl>(ele, part,round); }
 }
@@ -28,6 +28,9 @@
 #include "oqt/geometry/elements/simplepolygon.hpp"
 #include "oqt/geometry/elements/complicatedpolygon.hpp"
 
+#include <mutex>
+#include <optional>
+
 namespace oqt {
 namespace geometry {
 
@@ -37,14 +40,77 @@ class GeosGeometry {
         
         virtual void validate()=0;
         
+        //buffer(0) polygons already known to be invalid
+        virtual void make_valid()=0;
+        
         virtual std::string PointWkb()=0;
         virtual std::string Wkb()=0;
         virtual std::string BoundaryLineWkb()=0;
 };
 
+enum class GeometryValidity {
+    Valid,
+    Invalid,
+    Ambiguous
+};
+
+//checks polygons without geos, on the same projected (and if round,
+//rounded) coordinates. Points and linestrings are always Valid. Only
+//Valid results are certain: Ambiguous geometries should be checked with
+//geos, Invalid ones can go straight to make_valid.
+//Ring orientation is not checked: geos validity ignores it, and the
+//writers don't depend on it.
+GeometryValidity check_validity(std::shared_ptr<BaseGeometry> ele, bool round);
+GeometryValidity check_validity_cp_part(std::shared_ptr<ComplicatedPolygon> ele, size_t part, bool round);
+
 std::shared_ptr<GeosGeometry> make_geos_geometry(std::shared_ptr<BaseGeometry> ele, bool round);
 std::shared_ptr<GeosGeometry> make_geos_geometry_cp_part(std::shared_ptr<ComplicatedPolygon> ele, size_t part, bool round);
 
+//the geometries derived from an element, or from one part of a
+//complicated polygon, each computed when first needed so that they can be
+//shared between the tables the element is written to. Safe to use from
+//more than one thread. Only the results are kept: each geos geometry is
+//created and destroyed within one call, on the calling thread, as it
+//holds that thread's geos context.
+class DerivedGeometry {
+    public:
+        //part is -1 for the whole element
+        DerivedGeometry(std::shared_ptr<BaseGeometry> ele, int part, bool validate, bool round);
+        
+        ElementType Type() const { return ele->Type(); }
+        int Part() const { return part; }
+        
+        //written directly from the element, without geos or rounding
+        const std::string& Wkb();
+        
+        GeometryValidity Validity();
+        
+        //from geos, validated first if validate is set
+        const std::string& GeosWkb();
+        const std::string& PointWkb();
+        const std::string& BoundaryLineWkb();
+        
+        //computes those of GeosWkb, PointWkb and BoundaryLineWkb asked for
+        //from a single geos geometry
+        void PrepareGeos(bool geom, bool point, bool boundary_line);
+        
+    private:
+        std::shared_ptr<BaseGeometry> ele;
+        int part;
+        bool validate;
+        bool round;
+        
+        std::mutex mutex;
+        std::optional<std::string> wkb;
+        std::optional<GeometryValidity> validity;
+        std::optional<std::string> geos_wkb;
+        std::optional<std::string> point_wkb;
+        std::optional<std::string> boundary_line_wkb;
+        
+        GeometryValidity check_validity_locked();
+        void prepare_geos_locked(bool geom, bool point, bool boundary_line);
+};
+
 }
 }
 
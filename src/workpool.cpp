@@ -0,0 +1,116 @@
+/*****************************************************************************
+ *
+ * This file is part of osmquadtreepostgis
+ *
+ * Copyright (C) 2019 James Harris
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#include "workpool.hpp"
+
+namespace oqt {
+namespace geometry {
+
+//the pool and queue of the current thread, if it is a worker
+thread_local WorkStealingPool* worker_pool = nullptr;
+thread_local size_t worker_index = 0;
+
+WorkStealingPool::WorkStealingPool(size_t num_threads) : pending(0), stopped(false), next_queue(0) {
+    if (num_threads==0) { num_threads=1; }
+    for (size_t i=0; i < num_threads; i++) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i=0; i < num_threads; i++) {
+        threads.push_back(std::thread([this, i]() { run(i); }));
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lk(wait_mutex);
+        stopped=true;
+    }
+    cond.notify_all();
+    for (auto& t: threads) {
+        t.join();
+    }
+}
+
+int WorkStealingPool::current_worker() const {
+    if (worker_pool!=this) {
+        return -1;
+    }
+    return worker_index;
+}
+
+void WorkStealingPool::push(std::function<void()> task) {
+    size_t idx = (worker_pool==this) ? worker_index : (next_queue++ % queues.size());
+    //counted before the task can be popped, so that pending never drops
+    //below zero
+    {
+        std::lock_guard<std::mutex> lk(wait_mutex);
+        pending++;
+    }
+    {
+        std::lock_guard<std::mutex> lk(queues[idx]->mutex);
+        queues[idx]->tasks.push_back(std::move(task));
+    }
+    cond.notify_one();
+}
+
+bool WorkStealingPool::pop(size_t idx, std::function<void()>& task) {
+    for (size_t i=0; i < queues.size(); i++) {
+        auto& qu = *queues[(idx+i) % queues.size()];
+        {
+            std::lock_guard<std::mutex> lk(qu.mutex);
+            if (qu.tasks.empty()) { continue; }
+            if (i==0) {
+                task = std::move(qu.tasks.back());
+                qu.tasks.pop_back();
+            } else {
+                task = std::move(qu.tasks.front());
+                qu.tasks.pop_front();
+            }
+        }
+        std::lock_guard<std::mutex> lk(wait_mutex);
+        pending--;
+        return true;
+    }
+    return false;
+}
+
+void WorkStealingPool::run(size_t idx) {
+    worker_pool = this;
+    worker_index = idx;
+    
+    while (true) {
+        std::function<void()> task;
+        if (pop(idx, task)) {
+            task();
+            continue;
+        }
+        
+        std::unique_lock<std::mutex> lk(wait_mutex);
+        cond.wait(lk, [this]() { return stopped || (pending > 0); });
+        if (stopped && (pending==0)) {
+            return;
+        }
+    }
+}
+
+}
+}
@@ -0,0 +1,83 @@
+/*****************************************************************************
+ *
+ * This file is part of osmquadtreepostgis
+ *
+ * Copyright (C) 2019 James Harris
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *****************************************************************************/
+
+#ifndef OSMQUADTREEPOSTGIS_WORKPOOL_HPP
+#define OSMQUADTREEPOSTGIS_WORKPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace oqt {
+namespace geometry {
+
+//runs tasks on a fixed set of threads. Each thread has its own queue: tasks
+//submitted from a worker go to the back of its queue, and idle workers
+//steal from the front of the others.
+class WorkStealingPool {
+    public:
+        WorkStealingPool(size_t num_threads);
+        ~WorkStealingPool();
+        
+        template <class Func>
+        auto submit(Func func) -> std::future<decltype(func())> {
+            typedef decltype(func()) result_type;
+            auto task = std::make_shared<std::packaged_task<result_type()>>(std::move(func));
+            auto fut = task->get_future();
+            push([task]() { (*task)(); });
+            return fut;
+        }
+        
+        size_t num_threads() const { return threads.size(); }
+        
+        //index of the calling thread in this pool, or -1
+        int current_worker() const;
+        
+    private:
+        struct Queue {
+            std::mutex mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+        
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::vector<std::thread> threads;
+        
+        std::mutex wait_mutex;
+        std::condition_variable cond;
+        size_t pending;
+        bool stopped;
+        std::atomic<size_t> next_queue;
+        
+        void push(std::function<void()> task);
+        bool pop(size_t idx, std::function<void()>& task);
+        void run(size_t idx);
+};
+
+}
+}
+#endif